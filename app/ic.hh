@@ -65,6 +65,10 @@ class ICPlainOperations : public Operations {
         return true;
     }
 
+    size_t maxKeyLength() const {
+        return HASHLEN - 1;
+    }
+
     void* getValue(PartialAgg* p) const {
         ICPlainPAO* icp = (ICPlainPAO*)p;
         return &(icp->value_);
@@ -97,6 +101,22 @@ class ICPlainOperations : public Operations {
         return true;
     }
 
+    size_t paoSize() const {
+        return sizeof(ICPlainPAO);
+    }
+
+    PartialAgg* constructPAO(void* mem) const {
+        return new(mem) ICPlainPAO(NULL);
+    }
+
+    void destructPAO(PartialAgg* p) const {
+        ((ICPlainPAO*)p)->~ICPlainPAO();
+    }
+
+    bool arenaAllocatable() const {
+        return true;
+    }
+
 	bool merge(PartialAgg* p, PartialAgg* mg) const {
         ICValue* pv = &((ICPlainPAO*)p)->value_;
         ICValue* mv = &((ICPlainPAO*)mg)->value_;
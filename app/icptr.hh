@@ -68,6 +68,10 @@ class ICPtrOperations : public Operations {
         return true;
     }
 
+    size_t maxKeyLength() const {
+        return HASHLEN - 1;
+    }
+
     void* getValue(PartialAgg* p) const {
         ICPtrPAO* icp = (ICPtrPAO*)p;
         return &(icp->value_);
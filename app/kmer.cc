@@ -43,8 +43,10 @@
 #include "overlap_splitter.hh"
 #include "tokenizers.hh"
 #include "bench.hh"
+#include "topology.hh"
 #include "wc.hh"
 #include "wc_boost.h"
+#include "count_ops.hh"
 
 #define DEFAULT_NDISP 10
 
@@ -55,24 +57,37 @@
 enum { with_value_modifier = 1 };
 
 struct kmer : public mapreduce_appbase {
-    kmer(const char *f, int nsplit) : s_(f, nsplit) {}
+    // with @packed, k-mers are emitted as 2-bit packed integers (see
+    // split_kmer_packed), optionally @canonical
+    kmer(const char *f, int nsplit, uint32_t k, bool packed, bool canonical)
+        : s_(f, nsplit), k_(k), packed_(packed), canonical_(canonical),
+          format_(input_format(f)) {}
     bool split(split_t *ma, int ncores) {
         return s_.split(ma, ncores, " \t\r\n\0");
     }
     int key_compare(const void *s1, const void *s2) {
+        if (packed_) {
+            uint64_t k1 = key_traits<uint64_t>::load((const char *) s1);
+            uint64_t k2 = key_traits<uint64_t>::load((const char *) s2);
+            return k1 < k2 ? -1 : k1 > k2;
+        }
         return strcmp((const char *) s1, (const char *) s2);
     }
     void map_function(split_t *ma) {
-        char k[1024];
-        size_t klen;
-        do {
-            split_kmer sw(ma, 1024, 25);
-            while (sw.fill(k, 1024, klen)) {
-                k[klen] = '\0';
-                map_emit(k, (void *)(intptr_t)1, klen);
-                memset(k, 0, klen);
-            }
-        } while (s_.get_split_chunk(ma));
+        // the tokenizers carry reads over from one chunk to the next
+        if (packed_) {
+            uint64_t v;
+            split_kmer_packed sw(ma, k_, canonical_, format_);
+            while (s_.get_split_chunk(ma))
+                while (sw.next(v))
+                    map_emit_key(v, (void *)(intptr_t)1);
+            return;
+        }
+        const char *k;
+        split_kmer sw(ma, k_, format_);
+        while (s_.get_split_chunk(ma))
+            while (sw.next(k))
+                map_emit_view(k, (void *)(intptr_t)1, k_);
     }
     bool result_compare(const char* k1, const void* v1, 
             const char* k2, const void* v2) {
@@ -86,16 +101,44 @@ struct kmer : public mapreduce_appbase {
     }
 
     void print_record(FILE* f, const char* key, void* v) {
-            fprintf(f, "%15s - %d\n", key, ptr2int<unsigned>(v));
+        char bases[split_kmer_packed::kMaxK + 1];
+        if (packed_) {
+            split_kmer_packed::decode(key_traits<uint64_t>::load(key), k_,
+                    bases);
+            key = bases;
+        }
+        fprintf(f, "%15s - %d\n", key, ptr2int<unsigned>(v));
     }
   private:
+    // FASTQ if the input starts with '@', FASTA otherwise
+    static split_reads::format_t input_format(const char *f) {
+        FILE *in = fopen(f, "r");
+        int c = in ? fgetc(in) : EOF;
+        if (in)
+            fclose(in);
+        return c == '@' ? split_reads::FASTQ : split_reads::FASTA;
+    }
+
     overlap_splitter s_;
+    uint32_t k_;
+    bool packed_;
+    bool canonical_;
+    split_reads::format_t format_;
 };
 
 static void usage(char *prog) {
     printf("usage: %s <filename> [options]\n", prog);
     printf("options:\n");
     printf("  -p #procs : # of processors to use\n");
+    printf("  -b backend : aggregation backend (cbt, htc, sh, oa, nsort or auto)\n");
+    printf("  -k len : k-mer length (default 25, at most %d without -e or -x)\n",
+            KEYLEN - 1);
+    printf("  -e : emit k-mers 2-bit packed (k <= 32), aggregated by the u64 backend\n");
+    printf("  -C : with -e, count each k-mer together with its reverse complement\n");
+    printf("  -i reader : input reader (stdio, mmap, pread, uring or uring-direct)\n");
+    printf("  -P policy : thread placement (compact, scatter or socket)\n");
+    printf("  -z KB : input chunk size in KB (default 65536)\n");
+    printf("  -c nslots : combine repeated keys in a per-core cache of nslots\n");
     printf("  -m #map tasks : # of map tasks (pre-split input before MR)\n");
     printf("  -r #reduce tasks : # of reduce tasks\n");
     printf("  -l ntops : # of top val. pairs to display\n");
@@ -114,12 +157,34 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
     char *fn = argv[1];
     FILE *fout = NULL;
+    const char *backend = NULL;
+    const char *reader = NULL;
+    const char *placement = NULL;
+    size_t chunk_kb = 0;
+    int combiner_slots = 0;
+    uint32_t k = 25;
+    bool packed = false, canonical = false;
 
-    while ((c = getopt(argc - 1, argv + 1, "p:t:s:l:m:r:qxo:")) != -1) {
+    while ((c = getopt(argc - 1, argv + 1, "p:b:i:P:z:c:t:s:l:m:r:qxo:k:eC")) != -1) {
         switch (c) {
             case 'p':
                 nprocs = atoi(optarg);
                 break;
+            case 'b':
+                backend = optarg;
+                break;
+            case 'i':
+                reader = optarg;
+                break;
+            case 'P':
+                placement = optarg;
+                break;
+            case 'z':
+                chunk_kb = atol(optarg);
+                break;
+            case 'c':
+                combiner_slots = atoi(optarg);
+                break;
             case 't':
                 ntrees = atoi(optarg);
                 break;
@@ -135,6 +200,15 @@ int main(int argc, char *argv[]) {
             case 'x':
                 pointer_mode = 1;
                 break;
+            case 'k':
+                k = atoi(optarg);
+                break;
+            case 'e':
+                packed = true;
+                break;
+            case 'C':
+                canonical = true;
+                break;
             case 'o':
                 fout = fopen(optarg, "w+");
                 if (!fout) {
@@ -149,13 +223,41 @@ int main(int argc, char *argv[]) {
                 break;
         }
     }
+    if (reader && !chunk_reader::set_default(reader)) {
+        fprintf(stderr, "unknown reader %s\n", reader);
+        usage(argv[0]);
+    }
+    if (placement && !topology::set_policy(placement)) {
+        fprintf(stderr, "unknown placement %s\n", placement);
+        usage(argv[0]);
+    }
+    // WCPlainPAO keeps only KEYLEN - 1 bytes of a key, so longer k-mers
+    // would be counted by their prefix
+    if (k == 0 || (packed && k > split_kmer_packed::kMaxK) ||
+            (!packed && !pointer_mode && k > KEYLEN - 1)) {
+        fprintf(stderr, "unsupported k-mer length %u\n", k);
+        usage(argv[0]);
+    }
+    if (canonical && !packed) {
+        fprintf(stderr, "-C requires -e\n");
+        usage(argv[0]);
+    }
+    if (chunk_kb)
+        split_t::set_buffer_size(chunk_kb << 10);
     mapreduce_appbase::initialize();
     /* get input file */
-    kmer app(fn, map_tasks);
+    kmer app(fn, map_tasks, k, packed, canonical);
     app.set_ncore(nprocs);
     app.set_ntrees(ntrees);
+    app.set_combiner(combiner_slots);
+    if (backend && !app.set_backend(backend)) {
+        fprintf(stderr, "unknown backend %s\n", backend);
+        usage(argv[0]);
+    }
     Operations* ops;
-    if (pointer_mode)
+    if (packed)
+        ops = new CountOperations<uint64_t>();
+    else if (pointer_mode)
         ops = new WCBoostOperations();
     else
         ops = new WCPlainOperations();
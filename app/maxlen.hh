@@ -39,6 +39,10 @@ class MaxLenPlainOperations : public Operations {
         return true;
     }
 
+    size_t maxKeyLength() const {
+        return KEYLEN - 1;
+    }
+
     void* getValue(PartialAgg* p) const {
         MaxLenPlainPAO* wp = (MaxLenPlainPAO*)p;
         return (void*)(intptr_t)(wp->length);
@@ -69,6 +73,22 @@ class MaxLenPlainOperations : public Operations {
         return true;
     }
 
+    size_t paoSize() const {
+        return sizeof(MaxLenPlainPAO);
+    }
+
+    PartialAgg* constructPAO(void* mem) const {
+        return new(mem) MaxLenPlainPAO(NULL);
+    }
+
+    void destructPAO(PartialAgg* p) const {
+        ((MaxLenPlainPAO*)p)->~MaxLenPlainPAO();
+    }
+
+    bool arenaAllocatable() const {
+        return true;
+    }
+
 	bool merge(PartialAgg* p, PartialAgg* mg) const {
         ((MaxLenPlainPAO*)p)->length = std::max(((MaxLenPlainPAO*)p)->length,
                 ((MaxLenPlainPAO*)mg)->length);
@@ -25,7 +25,7 @@ struct img_cluster : public mapreduce_appbase {
         int num_rot = hash_len / step;
         bool not_empty = true;
         ICValue* ic_value = new ICValue();
-        do {
+        while (s_.get_split_chunk(ma)) {
             split_record sd(ma, s_.overlap(), " \t\n");
             do {
                 not_empty = sd.fill(k, 64, klen);
@@ -60,7 +60,7 @@ struct img_cluster : public mapreduce_appbase {
                 memset(k, 0, klen);
                 memset(v, 0, vlen);
             } while(not_empty);
-        } while (s_.get_split_chunk(ma));
+        }
         delete ic_value;
     }
     bool result_compare(const char* k1, const void* v1, 
@@ -125,7 +125,7 @@ struct nearest_neighbor : public mapreduce_appbase {
                         }
                     }
                 }
-                m_->ops()->destroyPAO(p);
+                m_->release_pao(p);
             }
         } while (ret);
         delete nnv;
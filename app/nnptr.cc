@@ -14,6 +14,7 @@
 #include <sys/time.h>
 #include <sched.h>
 #include "bench.hh"
+#include "topology.hh"
 #include "nnptr.hh"
 
 #define DEFAULT_NDISP 10
@@ -22,6 +23,10 @@ static void usage(char *prog) {
     printf("usage: %s <filename> [options]\n", prog);
     printf("options:\n");
     printf("  -p #procs : # of processors to use\n");
+    printf("  -b backend : aggregation backend (cbt, htc, sh, oa, nsort or auto)\n");
+    printf("  -i reader : input reader (stdio, mmap, pread, uring or uring-direct)\n");
+    printf("  -P policy : thread placement (compact, scatter or socket)\n");
+    printf("  -z KB : input chunk size in KB (default 65536)\n");
     printf("  -m #map tasks : # of map tasks (pre-split input before MR)\n");
     printf("  -r #reduce tasks : # of reduce tasks\n");
     printf("  -l ntops : # of top val. pairs to display\n");
@@ -39,12 +44,28 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
     char *fn = argv[1];
     FILE *fout = NULL;
+    const char *backend = NULL;
+    const char *reader = NULL;
+    const char *placement = NULL;
+    size_t chunk_kb = 0;
 
-    while ((c = getopt(argc - 1, argv + 1, "p:t:s:l:m:r:qao:")) != -1) {
+    while ((c = getopt(argc - 1, argv + 1, "p:b:i:P:z:t:s:l:m:r:qao:")) != -1) {
         switch (c) {
             case 'p':
                 nprocs = atoi(optarg);
                 break;
+            case 'b':
+                backend = optarg;
+                break;
+            case 'i':
+                reader = optarg;
+                break;
+            case 'P':
+                placement = optarg;
+                break;
+            case 'z':
+                chunk_kb = atol(optarg);
+                break;
             case 't':
                 ntrees = atoi(optarg);
                 break;
@@ -71,11 +92,25 @@ int main(int argc, char *argv[]) {
                 break;
         }
     }
+    if (reader && !chunk_reader::set_default(reader)) {
+        fprintf(stderr, "unknown reader %s\n", reader);
+        usage(argv[0]);
+    }
+    if (placement && !topology::set_policy(placement)) {
+        fprintf(stderr, "unknown placement %s\n", placement);
+        usage(argv[0]);
+    }
+    if (chunk_kb)
+        split_t::set_buffer_size(chunk_kb << 10);
     mapreduce_appbase::initialize();
     // cluster images using phash
     img_cluster ic(fn, map_tasks);
     ic.set_ncore(nprocs);
     ic.set_ntrees(ntrees);
+    if (backend && !ic.set_backend(backend)) {
+        fprintf(stderr, "unknown backend %s\n", backend);
+        usage(argv[0]);
+    }
     Operations* ic_ops = new ICPtrOperations();
     ic.set_ops(ic_ops);
     ic.set_skip_results_processing(true);
@@ -86,6 +121,8 @@ int main(int argc, char *argv[]) {
     nearest_neighbor nn(ic.results(), map_tasks);
     nn.set_ncore(nprocs);
     nn.set_ntrees(ntrees);
+    if (backend)
+        nn.set_backend(backend);
     Operations* nn_ops = new NNPlainOperations();
     nn.set_ops(nn_ops);
     // no need to sort results
@@ -29,7 +29,7 @@ struct img_cluster : public mapreduce_appbase {
         n.img = (char*)malloc(IDLEN);
         n.hash = (char*)malloc(HASHLEN);
         ic_value->neigh_.push_back(n);
-        do {
+        while (s_.get_split_chunk(ma)) {
             split_record sd(ma, s_.overlap(), " \t\n");
             do {
                 not_empty = sd.fill(k, 64, klen);
@@ -63,7 +63,7 @@ struct img_cluster : public mapreduce_appbase {
                 memset(k, 0, klen);
                 memset(v, 0, vlen);
             } while(not_empty);
-        } while (s_.get_split_chunk(ma));
+        }
         delete ic_value;
     }
     bool result_compare(const char* k1, const void* v1, 
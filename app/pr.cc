@@ -17,6 +17,7 @@
 #include "overlap_splitter.hh"
 #include "tokenizers.hh"
 #include "bench.hh"
+#include "topology.hh"
 #include "pr.hh"
 
 #define DEFAULT_NDISP 10
@@ -37,7 +38,7 @@ struct pr : public mapreduce_appbase {
 
         size_t record_len = 0;
         bool not_empty = true;
-        do {
+        while (s_.get_split_chunk(ma)) {
             split_large_record sd(ma, s_.overlap(), "\n");
             do {
                 not_empty = sd.fill(rec, max_record_len, record_len);
@@ -80,7 +81,7 @@ struct pr : public mapreduce_appbase {
                     map_emit(neigh_ptrs[i], &v, strlen(neigh_ptrs[i]));
                 }                    
             } while(not_empty);
-        } while (s_.get_split_chunk(ma));
+        }
     }
     bool result_compare(const char* k1, const void* v1, 
             const char* k2, const void* v2) {
@@ -104,6 +105,10 @@ static void usage(char *prog) {
     printf("usage: %s <filename> [options]\n", prog);
     printf("options:\n");
     printf("  -p #procs : # of processors to use\n");
+    printf("  -b backend : aggregation backend (cbt, htc, sh, oa, nsort or auto)\n");
+    printf("  -i reader : input reader (stdio, mmap, pread, uring or uring-direct)\n");
+    printf("  -P policy : thread placement (compact, scatter or socket)\n");
+    printf("  -z KB : input chunk size in KB (default 65536)\n");
     printf("  -m #map tasks : # of map tasks (pre-split input before MR)\n");
     printf("  -r #reduce tasks : # of reduce tasks\n");
     printf("  -l ntops : # of top val. pairs to display\n");
@@ -120,12 +125,28 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
     char *fn = argv[1];
     FILE *fout = NULL;
+    const char *backend = NULL;
+    const char *reader = NULL;
+    const char *placement = NULL;
+    size_t chunk_kb = 0;
 
-    while ((c = getopt(argc - 1, argv + 1, "p:t:s:l:m:r:qao:")) != -1) {
+    while ((c = getopt(argc - 1, argv + 1, "p:b:i:P:z:t:s:l:m:r:qao:")) != -1) {
         switch (c) {
             case 'p':
                 nprocs = atoi(optarg);
                 break;
+            case 'b':
+                backend = optarg;
+                break;
+            case 'i':
+                reader = optarg;
+                break;
+            case 'P':
+                placement = optarg;
+                break;
+            case 'z':
+                chunk_kb = atol(optarg);
+                break;
             case 't':
                 ntrees = atoi(optarg);
                 break;
@@ -152,11 +173,25 @@ int main(int argc, char *argv[]) {
                 break;
         }
     }
+    if (reader && !chunk_reader::set_default(reader)) {
+        fprintf(stderr, "unknown reader %s\n", reader);
+        usage(argv[0]);
+    }
+    if (placement && !topology::set_policy(placement)) {
+        fprintf(stderr, "unknown placement %s\n", placement);
+        usage(argv[0]);
+    }
+    if (chunk_kb)
+        split_t::set_buffer_size(chunk_kb << 10);
     mapreduce_appbase::initialize();
     /* get input file */
     pr app(fn, map_tasks);
     app.set_ncore(nprocs);
     app.set_ntrees(ntrees);
+    if (backend && !app.set_backend(backend)) {
+        fprintf(stderr, "unknown backend %s\n", backend);
+        usage(argv[0]);
+    }
     Operations* ops = new PageRankOperations();
     app.set_ops(ops);
 
@@ -41,6 +41,10 @@ class PageRankOperations : public Operations {
         return true;
     }
 
+    size_t maxKeyLength() const {
+        return KEYLEN - 1;
+    }
+
     void* getValue(PartialAgg* p) const {
         PageRankPAO* wp = (PageRankPAO*)p;
         return &(wp->pr);
@@ -69,6 +73,22 @@ class PageRankOperations : public Operations {
         return true;
     }
 
+    size_t paoSize() const {
+        return sizeof(PageRankPAO);
+    }
+
+    PartialAgg* constructPAO(void* mem) const {
+        return new(mem) PageRankPAO(NULL);
+    }
+
+    void destructPAO(PartialAgg* p) const {
+        ((PageRankPAO*)p)->~PageRankPAO();
+    }
+
+    bool arenaAllocatable() const {
+        return true;
+    }
+
 	bool merge(PartialAgg* p, PartialAgg* mg) const {
         PageRankPAO* pp = (PageRankPAO*)p;
         PageRankPAO* pmg = (PageRankPAO*)mg;
@@ -43,6 +43,7 @@
 #include "defsplitter.hh"
 #include "tokenizers.hh"
 #include "bench.hh"
+#include "topology.hh"
 #include "wc.hh"
 #include "wc_boost.h"
 
@@ -63,16 +64,13 @@ struct wc : public mapreduce_appbase {
         return strcmp((const char *) s1, (const char *) s2);
     }
     void map_function(split_t *ma) {
-        char k[1024];
+        const char* k;
         size_t klen;
-        do {
+        while (s_.get_split_chunk(ma)) {
             split_word sw(ma);
-            while (sw.fill(k, 1024, klen)) {
-                k[klen] = '\0';
-                map_emit(k, (void *)(intptr_t)1, klen);
-                memset(k, 0, klen);
-            }
-        } while (s_.get_split_chunk(ma));
+            while (sw.next(k, klen))
+                map_emit_view(k, (void *)(intptr_t)1, klen);
+        }
     }
     bool result_compare(const char* k1, const void* v1, 
             const char* k2, const void* v2) {
@@ -96,6 +94,11 @@ static void usage(char *prog) {
     printf("usage: %s <filename> [options]\n", prog);
     printf("options:\n");
     printf("  -p #procs : # of processors to use\n");
+    printf("  -b backend : aggregation backend (cbt, htc, sh, oa, nsort or auto)\n");
+    printf("  -i reader : input reader (stdio, mmap, pread, uring or uring-direct)\n");
+    printf("  -P policy : thread placement (compact, scatter or socket)\n");
+    printf("  -z KB : input chunk size in KB (default 65536)\n");
+    printf("  -c nslots : combine repeated keys in a per-core cache of nslots\n");
     printf("  -m #map tasks : # of map tasks (pre-split input before MR)\n");
     printf("  -r #reduce tasks : # of reduce tasks\n");
     printf("  -l ntops : # of top val. pairs to display\n");
@@ -114,12 +117,32 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
     char *fn = argv[1];
     FILE *fout = NULL;
+    const char *backend = NULL;
+    const char *reader = NULL;
+    const char *placement = NULL;
+    size_t chunk_kb = 0;
+    int combiner_slots = 0;
 
-    while ((c = getopt(argc - 1, argv + 1, "p:t:s:l:m:r:qxo:")) != -1) {
+    while ((c = getopt(argc - 1, argv + 1, "p:b:i:P:z:c:t:s:l:m:r:qxo:")) != -1) {
         switch (c) {
             case 'p':
                 nprocs = atoi(optarg);
                 break;
+            case 'b':
+                backend = optarg;
+                break;
+            case 'i':
+                reader = optarg;
+                break;
+            case 'P':
+                placement = optarg;
+                break;
+            case 'z':
+                chunk_kb = atol(optarg);
+                break;
+            case 'c':
+                combiner_slots = atoi(optarg);
+                break;
             case 't':
                 ntrees = atoi(optarg);
                 break;
@@ -149,11 +172,26 @@ int main(int argc, char *argv[]) {
                 break;
         }
     }
+    if (reader && !chunk_reader::set_default(reader)) {
+        fprintf(stderr, "unknown reader %s\n", reader);
+        usage(argv[0]);
+    }
+    if (placement && !topology::set_policy(placement)) {
+        fprintf(stderr, "unknown placement %s\n", placement);
+        usage(argv[0]);
+    }
+    if (chunk_kb)
+        split_t::set_buffer_size(chunk_kb << 10);
     mapreduce_appbase::initialize();
     /* get input file */
     wc app(fn, map_tasks);
     app.set_ncore(nprocs);
     app.set_ntrees(ntrees);
+    app.set_combiner(combiner_slots);
+    if (backend && !app.set_backend(backend)) {
+        fprintf(stderr, "unknown backend %s\n", backend);
+        usage(argv[0]);
+    }
     Operations* ops;
     if (pointer_mode)
         ops = new WCBoostOperations();
@@ -39,6 +39,19 @@ class WCPlainOperations : public Operations {
         return true;
     }
 
+    bool setKeyView(PartialAgg* p, const char* k, size_t len) const {
+        WCPlainPAO* wp = (WCPlainPAO*)p;
+        if (len > KEYLEN - 1)
+            len = KEYLEN - 1;
+        memcpy(wp->key, k, len);
+        wp->key[len] = 0;
+        return true;
+    }
+
+    size_t maxKeyLength() const {
+        return KEYLEN - 1;
+    }
+
     void* getValue(PartialAgg* p) const {
         WCPlainPAO* wp = (WCPlainPAO*)p;
         return (void*)(intptr_t)(wp->count);
@@ -69,6 +82,22 @@ class WCPlainOperations : public Operations {
         return true;
     }
 
+    size_t paoSize() const {
+        return sizeof(WCPlainPAO);
+    }
+
+    PartialAgg* constructPAO(void* mem) const {
+        return new(mem) WCPlainPAO(NULL);
+    }
+
+    void destructPAO(PartialAgg* p) const {
+        ((WCPlainPAO*)p)->~WCPlainPAO();
+    }
+
+    bool arenaAllocatable() const {
+        return true;
+    }
+
 	bool merge(PartialAgg* p, PartialAgg* mg) const {
         ((WCPlainPAO*)p)->count += ((WCPlainPAO*)mg)->count;
         return true;
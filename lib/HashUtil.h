@@ -67,6 +67,16 @@ class HashUtil {
     static uint32_t hashint_full_avalanche_1( uint32_t a);
     static uint32_t hashint_full_avalanche_2( uint32_t a);
     static uint32_t hashint_half_avalanche( uint32_t a);
+    // 64-bit integer hash (the MurmurHash3 finalizer), folded to 32 bits;
+    // inline, as it is meant for the emit path of fixed-width keys
+    static uint32_t hashint64(uint64_t a) {
+        a ^= a >> 33;
+        a *= 0xff51afd7ed558ccdULL;
+        a ^= a >> 33;
+        a *= 0xc4ceb9fe1a85ec53ULL;
+        a ^= a >> 33;
+        return (uint32_t)a;
+    }
 
     // Null hash (shift and mask)
     static uint32_t NullHash(const void* buf, size_t length, uint32_t shiftbytes);
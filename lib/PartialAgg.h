@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <new>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -81,11 +82,38 @@ class Operations {
     virtual ~Operations() {}
     virtual const char* getKey(PartialAgg* p) const = 0;
     virtual bool setKey(PartialAgg* p, char* k) const = 0;
+    /* set the key from the @len bytes at @k, which need not be NUL
+     * terminated (e.g. a view into the input). The default goes through a
+     * terminated copy; override it to copy straight into the PAO. */
+    virtual bool setKeyView(PartialAgg* p, const char* k, size_t len) const {
+        std::string s(k, len);
+        return setKey(p, &s[0]);
+    }
     virtual void* getValue(PartialAgg* p) const = 0;
     virtual void setValue(PartialAgg* p, void* v) const = 0;
     virtual bool sameKey(PartialAgg* p1, PartialAgg* p2) const = 0;
     virtual size_t createPAO(Token* t, PartialAgg** p_list) const = 0;
     virtual bool destroyPAO(PartialAgg* p) const = 0;
+    /* fixed-size PAOs: if paoSize() is non-zero, every PAO occupies
+     * paoSize() bytes and can be constructed in caller-provided memory with
+     * constructPAO() and torn down with destructPAO(), which must not free
+     * the memory */
+    virtual size_t paoSize() const { return 0; }
+    virtual PartialAgg* constructPAO(void* mem) const { return NULL; }
+    virtual void destructPAO(PartialAgg* p) const {}
+    /* fixed-size PAOs that own nothing outside their paoSize() bytes may
+     * be carved from per-aggregator arenas and freed wholesale, without
+     * destructPAO() being called */
+    virtual bool arenaAllocatable() const { return false; }
+    /* fixed-width keys: if keySize() is non-zero, keys are keySize() bytes
+     * hashed and compared by key_traits (see key_traits.hh) rather than
+     * NUL-terminated strings, and are aggregated by a fixed-key backend */
+    virtual size_t keySize() const { return 0; }
+    /* string keys: if maxKeyLength() is non-zero, setKey() and setKeyView()
+     * keep only that many bytes of a key. map_emit() and map_emit_view()
+     * then hash and measure keys as stored, so keys that only differ past
+     * the bound are one key in every backend. */
+    virtual size_t maxKeyLength() const { return 0; }
     virtual bool merge(PartialAgg* v, PartialAgg* merge) const = 0;
     virtual SerializationMethod getSerializationMethod() const = 0;
     virtual uint32_t getSerializedSize(PartialAgg* p) const = 0;
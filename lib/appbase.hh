@@ -17,18 +17,25 @@
 
 #include <dlfcn.h>
 #include <tbb/blocked_range.h>
-#include <semaphore.h>
+#include <string>
 
 #include "mr-types.hh"
 #include "profile.hh"
 #include "bench.hh"
+#include "map_scheduler.hh"
 #include "PartialAgg.h"
+#include "key_traits.hh"
+#include "threadinfo.hh"
 
 struct mapreduce_appbase;
+struct PAOArray;
 struct map_cbt_manager;
+struct map_combiner;
 
 struct static_appbase;
 
+/* @brief: arguments of an aggregator thread, which deletes them once it
+ * has read them */
 struct args_struct {
   public:
     explicit args_struct(uint32_t c) {
@@ -43,25 +50,77 @@ struct args_struct {
 };
 
 struct map_manager {
-    map_manager() : results_out_(NULL), ops_(NULL) {}
+    map_manager() : results_out_(NULL), ncore_(0), ops_(NULL),
+            stream_finalize_(false), id_(next_id()) {}
 
-    ~map_manager() {
-        sem_destroy(&phase_semaphore_);
-    }
+    virtual ~map_manager() {}
     
     const Operations* ops() const {
         assert(ops_);
         return ops_;
     }
-    virtual bool emit(void *key, void *val, size_t keylen, unsigned hash) = 0;
+    /* @brief: @view is true if @key is a view of @keylen bytes rather
+     * than a NUL terminated string (see map_emit_view) */
+    virtual bool emit(void *key, void *val, size_t keylen, unsigned hash,
+            bool view) = 0;
+    /* @brief: called once by every map worker after its last emit. Marks
+     * the end of that worker's stream to the aggregators. */
     virtual void flush_buffered_paos() {}
     virtual void finish_phase(int phase) {}
     virtual void finalize() {}
+    /* @brief: true if each aggregator thread can finalize its own
+     * partition once it has drained its queue */
+    virtual bool can_stream_finalize() const {
+        return false;
+    }
+    /* @brief: have the aggregator threads finalize their partitions as
+     * they finish, overlapping finalize with the tail of the map phase.
+     * Must be set before the map phase; the FINALIZE phase is then not
+     * run. */
+    void set_stream_finalize(bool v) {
+        stream_finalize_ = v;
+    }
+    bool stream_finalize() const {
+        return stream_finalize_;
+    }
+    /* @brief: number of workers the finalize phase should be run with */
+    virtual uint32_t num_finalize_workers() const {
+        return ncore_;
+    }
     virtual bool get_paos(PartialAgg** buf, uint64_t& num_read, uint64_t max) {
         assert(false && "Implement this if you want to use it");
     }
+    /* @brief: frees a PAO handed out by get_paos() */
+    virtual void release_pao(PartialAgg* p) {
+        ops_->destroyPAO(p);
+    }
+    /* @brief: frees every PAO in results_ at once if the backend owns their
+     * memory. Returns false if they have to be freed one by one. */
+    virtual bool release_results() {
+        return false;
+    }
 
   protected:
+    /* @brief: copy the key of an emit into @p */
+    void set_key(PartialAgg* p, void* key, size_t keylen, bool view) const {
+        if (view)
+            ops_->setKeyView(p, (const char*)key, keylen);
+        else
+            ops_->setKey(p, (char*)key);
+    }
+
+    /* @brief: the calling core's row (@stride entries) of a per-core array
+     * of buffer slots. Cached in threadinfo, so after the first emit on a
+     * thread this is a couple of loads. */
+    PAOArray** core_slots(PAOArray** base, uint32_t stride) {
+        threadinfo* ti = threadinfo::current();
+        if (ti->slot_owner_ != id_) {
+            ti->slots_ = base + ti->cur_core_ * stride;
+            ti->slot_owner_ = id_;
+        }
+        return (PAOArray**)ti->slots_;
+    }
+
     bool link_user_map(const std::string& soname) {
         const char* err;
         void* handle;
@@ -83,7 +142,6 @@ struct map_manager {
     }
 
   public:
-    sem_t phase_semaphore_;
     // results
     std::vector<PartialAgg*> results_;
     pthread_mutex_t results_mutex_;
@@ -92,6 +150,17 @@ struct map_manager {
   protected:
     uint32_t ncore_;
     Operations* ops_;
+    // read by the aggregator threads once their queues are drained
+    bool stream_finalize_;
+
+  private:
+    // managers may be reallocated at the same address, so the slot cache
+    // is keyed by a unique id
+    static uint64_t next_id() {
+        static uint64_t n = 0;
+        return __sync_add_and_fetch(&n, 1);
+    }
+    const uint64_t id_;
 };
 
 struct mapreduce_appbase {
@@ -151,6 +220,14 @@ struct mapreduce_appbase {
     }
     void set_ops(Operations* ops) {
         ops_ = ops;
+        max_keylen_ = ops->maxKeyLength();
+    }
+    /* @brief: select the aggregation backend by name (see
+     * map_manager_registry). "auto" samples the input and picks between
+     * the CBT and a hash table. Returns false if the name is unknown. */
+    bool set_backend(const std::string& name);
+    const std::string& backend() const {
+        return backend_;
     }
     static void initialize();
     static void deinitialize();
@@ -168,6 +245,21 @@ struct mapreduce_appbase {
         used, Metis calls the keycopy function for each new key, and user
         can free the key when this function returns. */
     void map_emit(void *key, void *val, int key_length);
+    /* @brief: like map_emit, but @key is a view of @key_length bytes (e.g.
+        into the input chunk) that need not be NUL terminated. The key is
+        copied only into the buffer that carries it to the aggregators,
+        and from there once more if it is new to its partition. */
+    void map_emit_view(const char *key, void *val, size_t key_length);
+    /* @brief: emit a fixed-width key (an integer, a packed k-mer or a
+        binary_key), hashed by key_traits<K> and handed to the PAO as a
+        view of its sizeof(K) bytes. Needs Operations whose keySize() is
+        sizeof(K); such keys go to the selected backend if it was added
+        for keys of that width, else to the built-in one (see
+        map_manager_registry::fixed_key_backend()). */
+    template <typename K>
+    void map_emit_key(const K& key, void *val) {
+        emit_hashed(&key, val, sizeof(K), key_traits<K>::hash(key));
+    }
     void sort(uint32_t uleft, uint32_t uright);
 
     void set_skip_results_processing(bool val) {
@@ -176,6 +268,12 @@ struct mapreduce_appbase {
     void set_skip_finalize(bool val) {
         skip_finalize_ = val;
     }
+    /* @brief: merge repeated keys on each map core in a direct-mapped
+     * cache of @nslots PAOs before they are handed to the map manager.
+     * 0 (the default) disables map-side combining. */
+    void set_combiner(uint32_t nslots) {
+        combiner_slots_ = nslots;
+    }
     map_manager* get_map_manager() {
         return m_;
     }
@@ -190,6 +288,11 @@ struct mapreduce_appbase {
     static void *base_worker(void *arg);
     void run_phase(int phase, int ncore, uint64_t &t);
     map_manager* create_map_manager();
+    // estimates key cardinality on a prefix of the input
+    std::string sample_backend();
+    // emits a view of @keylen bytes whose hash is already known
+    void emit_hashed(const void *key, void *val, size_t keylen,
+            unsigned hash);
     virtual void print_record(FILE* f, const char* key, void* v);
     void set_final_result();
     void reset();
@@ -198,6 +301,9 @@ struct mapreduce_appbase {
     int ncore_;   
     int ntree_;
     Operations* ops_;
+    // ops_->maxKeyLength(), looked up once rather than on every emit
+    size_t max_keylen_;
+    std::string backend_;
     uint64_t total_sample_time_;
     uint64_t total_map_time_;
     uint64_t total_finalize_time_;
@@ -206,11 +312,11 @@ struct mapreduce_appbase {
 
     bool skip_results_processing_;
     bool skip_finalize_;
+    uint32_t combiner_slots_;
+    // one per map core during the map phase if combining is enabled
+    map_combiner** combiners_;
     
-    int next_task() {
-        return atomic_add32_ret(&next_task_);
-    }
-    int next_task_;
+    map_scheduler sched_;
     int phase_;
     FILE* results_out_;
     xarray<split_t> ma_;
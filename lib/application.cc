@@ -26,18 +26,28 @@
 
 #include "appbase.hh"
 #include "bench.hh"
+#include "combiner.hh"
 #include "cpumap.hh"
 #include "thread.hh"
-#include "map_cbt_manager.hh"
-#include "map_htc_manager.hh"
-#include "map_sh_manager.hh"
-#include "map_nsort_manager.hh"
+#include "threadinfo.hh"
+#include "topology.hh"
+#include "map_manager_registry.hh"
+#include "map_sample_manager.hh"
 #include "array.hh"
 #include "HashUtil.h"
 
 //mapreduce_appbase *static_appbase::the_app_ = NULL;
 
 namespace {
+// backend used unless the application asks for another one
+const char* const kDefaultBackend = "cbt";
+// bytes of the first split that are mapped when sampling for "auto"
+const size_t kSampleBytes = 4 << 20;
+const uint64_t kSampleMaxEmits = 1000000;
+// if more than this fraction of the sampled keys are distinct, there is
+// too little aggregation for a hash table to beat the CBT
+const double kAutoDistinctRatio = 0.3;
+
 void pprint(const char *key, uint64_t v, const char *delim) {
     std::cout << key << "\t" << v << delim;
 }
@@ -48,12 +58,15 @@ void cprint(const char *key, uint64_t v, const char *delim) {
 }
 
 mapreduce_appbase::mapreduce_appbase() 
-    : ncore_(), ntree_(), total_sample_time_(),
+    : ncore_(), ntree_(), max_keylen_(0), backend_(kDefaultBackend),
+      total_sample_time_(),
       total_map_time_(), total_finalize_time_(),
       total_real_time_(), clean_(true),
       skip_results_processing_(true),
       skip_finalize_(false),
-      next_task_(), phase_(), m_(NULL) {
+      combiner_slots_(0),
+      combiners_(NULL),
+      phase_(), m_(NULL) {
 }
 
 mapreduce_appbase::~mapreduce_appbase() {
@@ -67,47 +80,89 @@ void mapreduce_appbase::deinitialize() {
     mthread_finalize();
 }
 
+bool mapreduce_appbase::set_backend(const std::string& name) {
+    if (name != "auto" && !map_manager_registry::has(name))
+        return false;
+    backend_ = name;
+    return true;
+}
+
+std::string mapreduce_appbase::sample_backend() {
+    if (ma_.size() == 0)
+        return kDefaultBackend;
+    split_t* first = ma_.at(0);
+    size_t split_length = first->split_end_offset - first->split_start_offset;
+    // splits that don't carry input (e.g. nn's second job) can't be sampled
+    if (!first->from_file || split_length == 0)
+        return kDefaultBackend;
+
+    uint64_t t0 = read_tsc();
+    // map a split covering the prefix of the first one; it loads its own
+    // chunk
+    split_t sample;
+    sample.from_file = true;
+    sample.split_start_offset = sample.chunk_start_offset =
+            sample.chunk_end_offset = first->split_start_offset;
+    sample.split_end_offset = first->split_start_offset +
+            std::min(split_length, kSampleBytes);
+
+    map_sample_manager* sampler = new map_sample_manager(kSampleMaxEmits);
+    m_ = sampler;
+    map_function(&sample);
+    m_ = NULL;
+
+    const char* ret = kDefaultBackend;
+    if (sampler->num_emits() > 0 && sampler->num_distinct() <
+            kAutoDistinctRatio * sampler->num_emits())
+        ret = "oa";
+    fprintf(stderr, "Sampled %lu keys (%lu distinct), using %s\n",
+            sampler->num_emits(), sampler->num_distinct(), ret);
+    delete sampler;
+    total_sample_time_ += read_tsc() - t0;
+    return ret;
+}
+
 map_manager *mapreduce_appbase::create_map_manager() {
-    map_manager* m;
-    switch (AGG_DS) {
-        case 0:
-            m = new map_cbt_manager();
-            ((map_cbt_manager*)m)->init(ops_, ncore_, ntree_);
-            break;
-        case 1:
-            m = new map_htc_manager();
-            ((map_htc_manager*)m)->init(ops_, ncore_);
-            break;
-        case 2:
-            m = new map_sh_manager();
-            ((map_sh_manager*)m)->init(ops_, ncore_, ntree_);
-            break;
-        case 3:
-            m = new map_nsort_manager();
-            ((map_nsort_manager*)m)->init(ops_, ncore_);
-            break;
+    std::string name = backend_;
+    if (ops_->keySize()) {
+        // fixed-width keys can only go to a fixed-key backend of their
+        // width: the selected one if it is (e.g. one added for the
+        // application's key type), else the built-in one
+        if (map_manager_registry::key_width(name) != ops_->keySize()) {
+            std::string fixed =
+                map_manager_registry::fixed_key_backend(ops_->keySize());
+            if (name != "auto")
+                fprintf(stderr, "%zu-byte keys, using backend %s\n",
+                        ops_->keySize(), fixed.c_str());
+            name = fixed;
+        }
+    } else if (name == "auto") {
+        name = sample_backend();
     }
+    map_manager* m = map_manager_registry::create(name, ops_, ncore_,
+            ntree_);
+    assert(m && "unknown aggregation backend");
     return m;
 }
 
 int mapreduce_appbase::map_worker() {
-    int n, next;
+    int n;
     cpu_set_t cset;
     CPU_ZERO(&cset);
-    CPU_SET(threadinfo::current()->cur_core_, &cset);
+    CPU_SET(cpumap_physical_cpuid(threadinfo::current()->cur_core_), &cset);
     pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
-    sem_wait(&m_->phase_semaphore_);
 /*
     pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
     for (uint32_t i = 0; i < JOS_NCPU; ++i)
         if (CPU_ISSET(i, &cset))
             fprintf(stderr, "%d: CPU %d\n", pthread_self(), i);
 */
-    for (n = 0; (next = next_task()) < int(ma_.size()); ++n) {
+    uint32_t next;
+    for (n = 0; sched_.next(threadinfo::current()->cur_core_, next); ++n)
         map_function(ma_.at(next));
-    }
+    if (combiners_)
+        combiners_[threadinfo::current()->cur_core_]->flush(m_);
     m_->flush_buffered_paos();
-    sem_post(&m_->phase_semaphore_);
     return n;
 }
 
@@ -148,7 +203,6 @@ void mapreduce_appbase::run_phase(int phase, int nworkers, uint64_t &t) {
     pthread_t tid[JOS_NCPU];
     phase_ = phase;
 
-    sem_init(&m_->phase_semaphore_, 0, nworkers);
     for (int i = 0; i < nworkers; ++i) {
         if (i == main_core)
             continue;
@@ -178,20 +232,33 @@ int mapreduce_appbase::sched_run() {
     if (!ntree_)
         ntree_ = 1;
 
-    // pre-split
+    // pre-split; the descriptors don't hold buffers yet, so they can be
+    // copied
     ma_.clear();
     while (true) {
-        split_t* ma = new split_t();
-        if (split(ma, ncore_))
-            ma_.push_back(*ma);
-        else {
-            delete ma;
+        split_t ma;
+        if (!split(&ma, ncore_))
             break;
-        }
+        ma_.push_back(ma);
     }
+    // a map worker holds the buffers of one split at a time: the current
+    // chunk and the one being prefetched. One more for sampling, and one
+    // per core for the readers to read the first chunks of the next splits
+    // ahead.
+    split_t::set_max_buffers(3 * ncore_ + 1, ncore_);
 
     m_ = create_map_manager();
     m_->results_out_ = results_out_;
+    // backends with independent partitions finalize each one as soon as
+    // it has been drained, overlapping the tail of the map phase
+    m_->set_stream_finalize(!skip_finalize_ && m_->can_stream_finalize());
+
+    // created after create_map_manager() so sampling bypasses them
+    if (combiner_slots_) {
+        combiners_ = new map_combiner*[ncore_];
+        for (int i = 0; i < ncore_; ++i)
+            combiners_[i] = new map_combiner(m_->ops(), combiner_slots_);
+    }
 
     uint64_t real_start = read_tsc();
     uint64_t map_time = 0;
@@ -199,31 +266,32 @@ int mapreduce_appbase::sched_run() {
 
     // map phase
     uint32_t num_map_workers = ncore_;
+    sched_.init(ma_.size(), num_map_workers);
     mthread_init(num_map_workers);
     run_phase(MAP, num_map_workers, map_time);
     m_->finish_phase(MAP);
-    mthread_finalize();
+    sched_.print_stats(stderr);
+
+    if (combiners_) {
+        uint64_t nemits = 0, ncombined = 0;
+        for (int i = 0; i < ncore_; ++i) {
+            nemits += combiners_[i]->num_emits();
+            ncombined += combiners_[i]->num_combined();
+            delete combiners_[i];
+        }
+        delete[] combiners_;
+        combiners_ = NULL;
+        fprintf(stderr, "Combiner: %lu emits, %lu combined\n", nemits,
+                ncombined);
+    }
     
     // finalize phase
     if (!skip_finalize_) {
-        uint32_t num_finalize_workers;
-        switch(AGG_DS) {
-            case 0: // CBT
-                num_finalize_workers = ntree_ * 2;
-                break;
-            case 1: // HTC
-                num_finalize_workers = ncore_;
-                break;
-            case 2: // SH
-                num_finalize_workers = ntree_;
-                break;
-            case 3: // nsort
-                num_finalize_workers = ncore_;
-                break;
+        if (!m_->stream_finalize()) {
+            uint32_t num_finalize_workers = m_->num_finalize_workers();
+            mthread_init(num_finalize_workers);
+            run_phase(FINALIZE, num_finalize_workers, finalize_time);
         }
-        mthread_init(num_finalize_workers);
-        run_phase(FINALIZE, num_finalize_workers, finalize_time);
-        mthread_finalize();
 
         fprintf(stderr, "Results has %lu elements\n", m_->results_.size());
     }
@@ -252,8 +320,30 @@ void mapreduce_appbase::print_stats(void) {
 }
 
 void mapreduce_appbase::map_emit(void *k, void *v, int keylen) {
+    if (max_keylen_ && size_t(keylen) > max_keylen_)
+        keylen = max_keylen_;
     unsigned hash = HashUtil::MurmurHash(k, keylen, 42);
-    m_->emit(k, v, keylen, hash);
+    if (combiners_)
+        combiners_[threadinfo::current()->cur_core_]->emit(m_, k, v, keylen,
+                hash, false);
+    else
+        m_->emit(k, v, keylen, hash, false);
+}
+
+void mapreduce_appbase::map_emit_view(const char *k, void *v,
+        size_t keylen) {
+    if (max_keylen_ && keylen > max_keylen_)
+        keylen = max_keylen_;
+    emit_hashed(k, v, keylen, HashUtil::MurmurHash(k, keylen, 42));
+}
+
+void mapreduce_appbase::emit_hashed(const void *k, void *v, size_t keylen,
+        unsigned hash) {
+    if (combiners_)
+        combiners_[threadinfo::current()->cur_core_]->emit(m_, (void*)k, v,
+                keylen, hash, true);
+    else
+        m_->emit((void*)k, v, keylen, hash, true);
 }
 
 void mapreduce_appbase::reset() {
@@ -413,6 +503,12 @@ void mapreduce_appbase::free_results() {
     if (skip_results_processing_)
         return;
 
+    // backends that allocate results from arenas drop them wholesale
+    if (m_->release_results()) {
+        m_->results_.clear();
+        return;
+    }
+
     const Operations* ops = m_->ops();
 
     cpu_set_t oldcset, cset;
@@ -420,9 +516,7 @@ void mapreduce_appbase::free_results() {
     pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &oldcset);
 
     // allow to use all CPUs
-    CPU_ZERO(&cset);
-    for (uint32_t i = 0; i < JOS_NCPU; ++i)
-        (CPU_SET(i, &cset));
+    topology::get().all_cpus(&cset);
     pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
 
 /*
@@ -445,9 +539,7 @@ void mapreduce_appbase::set_final_result() {
     pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &oldcset);
 
     // allow sort to use all CPUs
-    CPU_ZERO(&cset);
-    for (uint32_t i = 0; i < JOS_NCPU; ++i)
-        (CPU_SET(i, &cset));
+    topology::get().all_cpus(&cset);
     pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
 
     ResultComparator* sorter = new ResultComparator(m_->ops(), this);
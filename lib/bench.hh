@@ -30,6 +30,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include <new>
 
 #define JOS_PAGESIZE    4096
 enum { debug_print = 0 };
@@ -53,6 +54,28 @@ inline T *safe_malloc(int n = 1) {
     return (T *)x;
 }
 
+/* @brief: @n default-constructed T on a cache-line boundary. Use it for
+ * arrays of cache-line aligned types: new[] does not honour their
+ * alignment before C++17. Free with delete_cline_array(). */
+template <typename T>
+inline T *new_cline_array(size_t n) {
+    T *a = NULL;
+    int ret = posix_memalign((void **)&a, JOS_CLINE, n * sizeof(T));
+    assert(ret == 0);
+    for (size_t i = 0; i < n; ++i)
+        new(&a[i]) T();
+    return a;
+}
+
+template <typename T>
+inline void delete_cline_array(T *a, size_t n) {
+    if (!a)
+        return;
+    for (size_t i = 0; i < n; ++i)
+        a[i].~T();
+    free(a);
+}
+
 #define cond_printf(__exp, __fmt, __args...) \
 do { \
     if (__exp) \
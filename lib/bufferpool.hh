@@ -2,24 +2,59 @@
 #define BUFFERPOOL_HH 1
 
 #include <assert.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
 #include <boost/pool/object_pool.hpp>
 
+#include "bench.hh"
+#include "futex.hh"
+#include "topology.hh"
 #include "PartialAgg.h"
 
 struct PAOArray {
   public:
     explicit PAOArray(const Operations* ops, uint32_t max) :
             ops_(ops), kMaxListSize(max),
-            list_(NULL), index_(0) {
+            list_(NULL), hashes_(NULL), keylens_(NULL), index_(0),
+            slab_(NULL), stride_(0),
+            pool_id_(0), pool_shard_(0), pool_next_(0) {
+        // zeroed so that the pages are faulted in here, on the node the
+        // pool is built for
         list_ = new PartialAgg*[kMaxListSize];
-        for (uint32_t i = 0; i < kMaxListSize; ++i)
-            ops_->createPAO(NULL, &list_[i]);
+        hashes_ = new uint32_t[kMaxListSize]();
+        keylens_ = new uint32_t[kMaxListSize]();
+        size_t pao_size = ops_->paoSize();
+        if (pao_size) {
+            // fixed-size PAOs live back to back in one cache-aligned slab
+            // instead of in kMaxListSize separate heap objects
+            stride_ = round_up(pao_size, sizeof(void*));
+            int ret = posix_memalign((void**)&slab_, JOS_CLINE,
+                    stride_ * kMaxListSize);
+            assert(ret == 0 && slab_);
+            for (uint32_t i = 0; i < kMaxListSize; ++i)
+                list_[i] = ops_->constructPAO(slab_ + i * stride_);
+        } else {
+            for (uint32_t i = 0; i < kMaxListSize; ++i)
+                ops_->createPAO(NULL, &list_[i]);
+        }
     }
     ~PAOArray() {
-        for (uint32_t i = 0; i < kMaxListSize; ++i)
-            ops_->destroyPAO(list_[i]);
+        if (slab_) {
+            // list_ may have been repointed (e.g. by CBT reads), so walk the
+            // slab itself
+            for (uint32_t i = 0; i < kMaxListSize; ++i)
+                ops_->destructPAO((PartialAgg*)(slab_ + i * stride_));
+            free(slab_);
+        } else {
+            for (uint32_t i = 0; i < kMaxListSize; ++i)
+                ops_->destroyPAO(list_[i]);
+        }
         delete[] list_;
+        delete[] hashes_;
+        delete[] keylens_;
     }
     void init() {
         index_ = 0;
@@ -31,6 +66,14 @@ struct PAOArray {
     PartialAgg** list() {
         return list_;
     }
+    /* @brief: emit-time hash and key length of each entry, filled in by
+     * the backends that reuse them downstream */
+    uint32_t* hashes() {
+        return hashes_;
+    }
+    uint32_t* keylens() {
+        return keylens_;
+    }
     uint32_t index() {
         return index_;
     }
@@ -41,55 +84,244 @@ struct PAOArray {
     const Operations* ops_;
     const uint32_t kMaxListSize; 
     PartialAgg** list_;
+    uint32_t* hashes_;
+    uint32_t* keylens_;
     uint32_t index_;
+    // backing store for fixed-size PAOs, NULL otherwise
+    char* slab_;
+    size_t stride_;
+
+    // owned by bufferpool
+    friend struct bufferpool;
+    uint32_t pool_id_;
+    uint32_t pool_shard_;
+    uint32_t pool_next_;
 };
 
+/* @brief: Pool of PAOArrays shared by the map workers (which take empty
+ * arrays) and the aggregator threads (which give them back). Every map core
+ * has its own free list, and an array is returned to the list of the core
+ * that took it, so in the common case a core never touches another core's
+ * list. If a core's list is empty it takes from the global overflow stack
+ * and then steals from the other cores; only if the whole pool is empty
+ * does it sleep. All lists are lock-free (tagged Treiber stacks). */
 struct bufferpool {
     explicit bufferpool(const Operations* ops, uint32_t max_elements_per_array,
-            uint32_t max_num_arrays) :
+            uint32_t max_num_arrays, uint32_t nshards) :
             ops_(ops),
             max_elements_per_array_(max_elements_per_array),
-            max_number_of_arrays_(max_num_arrays) {
-        pthread_mutex_init(&lock_, NULL);
-        pthread_cond_init(&empty_, NULL);
+            max_number_of_arrays_(max_num_arrays),
+            nshards_(nshards),
+            kMaxLocal(2 * (max_num_arrays / nshards) + 1),
+            global_(0), avail_seq_(0), nwaiters_(0) {
+        arrays_ = new PAOArray*[max_number_of_arrays_];
+        shards_ = new_cline_array<shard>(nshards_);
         for (uint32_t i = 0; i < max_number_of_arrays_; ++i) {
             PAOArray* pa = new PAOArray(ops_, max_elements_per_array_);
-            arrays_.push_back(pa);
+            pa->pool_id_ = i;
+            pa->pool_shard_ = kNoShard;
+            arrays_[i] = pa;
+            push(&global_, pa);
         }
     }
     ~bufferpool() {
-        pthread_mutex_destroy(&lock_);
-        pthread_cond_destroy(&empty_);
-        for (uint32_t i = 0; i < max_number_of_arrays_; ++i) {
-            PAOArray* pa = arrays_.front();
-            arrays_.pop_front();
-            delete pa;
-        }
+        for (uint32_t i = 0; i < max_number_of_arrays_; ++i)
+            delete arrays_[i];
+        delete[] arrays_;
+        delete_cline_array(shards_, nshards_);
     }
-    PAOArray* get_buffer() {
-        pthread_mutex_lock(&lock_);
-        while (arrays_.empty()) {
-            pthread_cond_wait(&empty_, &lock_);
+    /* @brief: @shard_id is the calling map core (or any stable id below
+     * nshards for other callers) */
+    PAOArray* get_buffer(uint32_t shard_id) {
+        assert(shard_id < nshards_);
+        shard& sh = shards_[shard_id];
+        PAOArray* ret;
+        uint64_t t0 = 0;
+        while (true) {
+            int seq = __atomic_load_n(&avail_seq_, __ATOMIC_ACQUIRE);
+            if ((ret = take(shard_id)))
+                break;
+            // nothing anywhere: wait for an aggregator to return an array
+            if (!t0) {
+                t0 = read_tsc();
+                __atomic_add_fetch(&sh.stalls, 1, __ATOMIC_RELAXED);
+            }
+            __atomic_add_fetch(&nwaiters_, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&avail_seq_, __ATOMIC_SEQ_CST) == seq)
+                futex_wait(&avail_seq_, seq);
+            __atomic_sub_fetch(&nwaiters_, 1, __ATOMIC_SEQ_CST);
         }
-        PAOArray* ret = arrays_.front();
-        arrays_.pop_front();
-        pthread_mutex_unlock(&lock_);
+        if (t0)
+            __atomic_add_fetch(&sh.stall_cycles, read_tsc() - t0,
+                    __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sh.gets, 1, __ATOMIC_RELAXED);
+        ret->pool_shard_ = shard_id;
         return ret;
     }
     void return_buffer(PAOArray* a) {
         a->init();
-        pthread_mutex_lock(&lock_);
-        arrays_.push_back(a);
-        pthread_cond_signal(&empty_);
-        pthread_mutex_unlock(&lock_);
+        uint32_t shard_id = a->pool_shard_;
+        if (shard_id != kNoShard && __atomic_load_n(&shards_[shard_id].size,
+                __ATOMIC_RELAXED) < kMaxLocal) {
+            __atomic_add_fetch(&shards_[shard_id].size, 1, __ATOMIC_RELAXED);
+            push(&shards_[shard_id].free, a);
+        } else {
+            push(&global_, a);
+        }
+        __atomic_add_fetch(&avail_seq_, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&nwaiters_, __ATOMIC_SEQ_CST))
+            futex_wake(&avail_seq_, INT_MAX);
+    }
+    void print_stats(FILE* f) {
+        uint64_t gets = 0, steals = 0, stalls = 0, stall_cycles = 0;
+        for (uint32_t i = 0; i < nshards_; ++i) {
+            const shard& sh = shards_[i];
+            gets += __atomic_load_n(&sh.gets, __ATOMIC_RELAXED);
+            steals += __atomic_load_n(&sh.steals, __ATOMIC_RELAXED);
+            stalls += __atomic_load_n(&sh.stalls, __ATOMIC_RELAXED);
+            stall_cycles += __atomic_load_n(&sh.stall_cycles,
+                    __ATOMIC_RELAXED);
+        }
+        fprintf(f, "Buffer pool: %lu gets, %lu steals, %lu stalls (%lu ms)\n",
+                gets, steals, stalls, cycle_to_ms(stall_cycles));
     }
   private:
+    enum { kNoShard = 0xffffffff };
+
+    // head of a free list: (ABA tag << 32) | (pool id + 1); 0 is empty
+    typedef uint64_t free_list_t;
+
+    struct __attribute__ ((aligned(JOS_CLINE))) shard {
+        shard() : free(0), size(0), gets(0), steals(0), stalls(0),
+                stall_cycles(0) {}
+        free_list_t free;
+        uint32_t size;
+        // mostly bumped by the owning core, but finalize workers and
+        // aggregators also take buffers under a shard id, so the updates
+        // are relaxed atomics
+        uint64_t gets;
+        uint64_t steals;
+        uint64_t stalls;
+        uint64_t stall_cycles;
+    };
+
+    void push(free_list_t* s, PAOArray* a) {
+        free_list_t old = __atomic_load_n(s, __ATOMIC_RELAXED);
+        free_list_t upd;
+        do {
+            __atomic_store_n(&a->pool_next_, (uint32_t)old, __ATOMIC_RELAXED);
+            upd = (((old >> 32) + 1) << 32) | (a->pool_id_ + 1);
+        } while (!__atomic_compare_exchange_n(s, &old, upd, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    PAOArray* pop(free_list_t* s) {
+        free_list_t old = __atomic_load_n(s, __ATOMIC_ACQUIRE);
+        free_list_t upd;
+        PAOArray* a;
+        do {
+            if ((uint32_t)old == 0)
+                return NULL;
+            a = arrays_[(uint32_t)old - 1];
+            // may be stale if another thread popped @a meanwhile; the tag
+            // makes the CAS fail in that case
+            upd = (((old >> 32) + 1) << 32) |
+                    __atomic_load_n(&a->pool_next_, __ATOMIC_RELAXED);
+        } while (!__atomic_compare_exchange_n(s, &old, upd, true,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+        return a;
+    }
+
+    PAOArray* take(uint32_t shard_id) {
+        PAOArray* a;
+        if ((a = pop(&shards_[shard_id].free))) {
+            __atomic_sub_fetch(&shards_[shard_id].size, 1, __ATOMIC_RELAXED);
+            return a;
+        }
+        if ((a = pop(&global_)))
+            return a;
+        for (uint32_t i = 1; i < nshards_; ++i) {
+            uint32_t victim = (shard_id + i) % nshards_;
+            if ((a = pop(&shards_[victim].free))) {
+                __atomic_sub_fetch(&shards_[victim].size, 1,
+                        __ATOMIC_RELAXED);
+                __atomic_add_fetch(&shards_[shard_id].steals, 1,
+                        __ATOMIC_RELAXED);
+                return a;
+            }
+        }
+        return NULL;
+    }
+
     const Operations* ops_;
     const uint32_t max_elements_per_array_;
     const uint32_t max_number_of_arrays_;
-    std::deque<PAOArray*> arrays_;
-    pthread_mutex_t lock_;
-    pthread_cond_t empty_;
+    const uint32_t nshards_;
+    // longest a per-core list gets before returns spill to global_
+    const uint32_t kMaxLocal;
+    PAOArray** arrays_;
+    shard* shards_;
+    char pad0_[JOS_CLINE];
+    free_list_t global_;
+    char pad1_[JOS_CLINE];
+    // bumped on every return; get_buffer sleeps on it when the pool is dry
+    int avail_seq_;
+    int nwaiters_;
+    char pad2_[JOS_CLINE];
+};
+
+/* @brief: The PAOArrays of a partitioned backend, with one bufferpool per
+ * NUMA node that partitions are homed on (see topology::home_node). The
+ * arrays headed for a partition are allocated on its node, so that its
+ * aggregator reads them locally; the map cores fill them remotely and hand
+ * each one over whole. Without NUMA homes this is a single bufferpool. */
+struct numa_bufferpool {
+    explicit numa_bufferpool(const Operations* ops,
+            uint32_t max_elements_per_array, uint32_t arrays_per_part,
+            uint32_t nparts, uint32_t nshards) {
+        const topology& t = topology::get();
+        std::vector<int> nodes;
+        std::vector<uint32_t> nparts_on;
+        part_pool_ = new uint32_t[nparts];
+        for (uint32_t j = 0; j < nparts; ++j) {
+            int node = t.home_node(j, nparts);
+            uint32_t k = 0;
+            while (k < nodes.size() && nodes[k] != node)
+                ++k;
+            if (k == nodes.size()) {
+                nodes.push_back(node);
+                nparts_on.push_back(0);
+            }
+            part_pool_[j] = k;
+            ++nparts_on[k];
+        }
+        for (uint32_t k = 0; k < nodes.size(); ++k) {
+            numa_preferred on(nodes[k]);
+            pools_.push_back(new bufferpool(ops, max_elements_per_array,
+                    arrays_per_part * nparts_on[k], nshards));
+        }
+    }
+    ~numa_bufferpool() {
+        for (uint32_t k = 0; k < pools_.size(); ++k)
+            delete pools_[k];
+        delete[] part_pool_;
+    }
+    /* @brief: an empty array for partition @part; @shard_id as for
+     * bufferpool::get_buffer */
+    PAOArray* get_buffer(uint32_t part, uint32_t shard_id) {
+        return pools_[part_pool_[part]]->get_buffer(shard_id);
+    }
+    void return_buffer(uint32_t part, PAOArray* a) {
+        pools_[part_pool_[part]]->return_buffer(a);
+    }
+    void print_stats(FILE* f) {
+        for (uint32_t k = 0; k < pools_.size(); ++k)
+            pools_[k]->print_stats(f);
+    }
+  private:
+    std::vector<bufferpool*> pools_;
+    // index into pools_ of each partition
+    uint32_t* part_pool_;
 };
 
 #endif  // BUFFERPOOL_HH
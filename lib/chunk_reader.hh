@@ -0,0 +1,461 @@
+#ifndef CHUNK_READER_HH_
+#define CHUNK_READER_HH_ 1
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <utility>
+
+#include "bench.hh"
+#include "futex.hh"
+#include "mr-types.hh"
+#include "uring.hh"
+
+/* @brief: Loads the chunks of a split from the input file; shared by the
+ * splitters. The reader type is process-wide and chosen with set_default()
+ * before the application (and hence its splitter) is created:
+ *  - stdio: fread() into the split's buffer under a file lock
+ *  - mmap:  map each chunk privately; no copy and no lock
+ *  - pread: pread() without a lock. A background thread reads the first
+ *           chunks of the splits ahead, in the order the splitter cut
+ *           them (the order in which map_scheduler starts them), into the
+ *           buffers set_max_buffers() sets aside for it. While a chunk is
+ *           processed, it reads the next chunk of the same split into a
+ *           second buffer (split_t::next).
+ *  - uring: like pread, but all reads go through one io_uring instead of
+ *           a thread. "uring-direct" also opens the file with O_DIRECT.
+ *           Falls back to pread (or to buffered I/O) if the kernel or the
+ *           filesystem refuses. */
+struct chunk_reader {
+    enum reader_t {
+        STDIO_READER,
+        MMAP_READER,
+        PREAD_READER,
+        URING_READER,
+    };
+
+    explicit chunk_reader(const char* f) :
+            type_(default_type()), f_(NULL), size_(0), fd_(-1), align_(1),
+            prefetcher_started_(false), stop_(false), ring_(NULL),
+            inflight_(0) {
+        f_ = fopen(f, "r");
+        assert(f_);
+        fseek(f_, 0, SEEK_END);
+        size_ = ftell(f_);
+        rewind(f_);
+        fd_ = fileno(f_);
+
+        pthread_mutex_init(&flock_, NULL);
+        pthread_mutex_init(&qlock_, NULL);
+        pthread_cond_init(&qcond_, NULL);
+        pthread_mutex_init(&rlock_, NULL);
+
+        if (type_ == URING_READER) {
+            ring_ = new uring();
+            if (!ring_->init(kQueueDepth)) {
+                perror("io_uring, using pread");
+                delete ring_;
+                ring_ = NULL;
+                type_ = PREAD_READER;
+            }
+        }
+        if (type_ == URING_READER && default_direct()) {
+            int fd = open(f, O_RDONLY | O_DIRECT);
+            if (fd >= 0) {
+                fd_ = fd;
+                align_ = kDirectAlign;
+            } else {
+                perror("O_DIRECT, using buffered reads");
+            }
+        }
+    }
+    ~chunk_reader() {
+        if (prefetcher_started_) {
+            pthread_mutex_lock(&qlock_);
+            stop_ = true;
+            pthread_cond_signal(&qcond_);
+            pthread_mutex_unlock(&qlock_);
+            pthread_join(prefetcher_, NULL);
+        }
+        if (ring_) {
+            // the kernel may still be writing into split buffers
+            pthread_mutex_lock(&rlock_);
+            while (inflight_)
+                reap_completions();
+            pthread_mutex_unlock(&rlock_);
+            delete ring_;
+        }
+        // chunks read ahead for splits that were never mapped
+        for (size_t i = 0; i < ahead_.size(); ++i) {
+            split_t::claim_ahead_buffer();
+            split_t::put_buffer(ahead_[i]->data);
+            delete ahead_[i];
+        }
+        if (fd_ != fileno(f_))
+            close(fd_);
+        fclose(f_);
+        pthread_mutex_destroy(&flock_);
+        pthread_mutex_destroy(&qlock_);
+        pthread_cond_destroy(&qcond_);
+        pthread_mutex_destroy(&rlock_);
+    }
+
+    /* @brief: select the reader by name ("stdio", "mmap", "pread", "uring"
+     * or "uring-direct"). Returns false if the name is unknown. */
+    static bool set_default(const std::string& name) {
+        default_direct() = false;
+        if (name == "stdio")
+            default_type() = STDIO_READER;
+        else if (name == "mmap")
+            default_type() = MMAP_READER;
+        else if (name == "pread")
+            default_type() = PREAD_READER;
+        else if (name == "uring")
+            default_type() = URING_READER;
+        else if (name == "uring-direct") {
+            default_type() = URING_READER;
+            default_direct() = true;
+        } else
+            return false;
+        return true;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    /* @brief: note the first chunk of the split @ma just cut, to be read
+     * ahead by the pread and uring readers. Splits are noted in order. */
+    void read_ahead(const split_t* ma) {
+        if (type_ != PREAD_READER && type_ != URING_READER)
+            return;
+        size_t length = std::min(ma->kBufferSize,
+                ma->split_end_offset - ma->split_start_offset);
+        if (!length)
+            return;
+        pthread_mutex_lock(&qlock_);
+        planned_.push_back(std::make_pair(ma->split_start_offset, length));
+        pthread_mutex_unlock(&qlock_);
+    }
+
+    /* @brief: load the chunk following the current one of @ma (the first
+     * one if none is loaded yet). Returns false, and gives the buffers back
+     * to the pool, once the split is exhausted. The pread and uring readers
+     * take the chunk read ahead or prefetched for it if there is one, and
+     * start loading the chunk after it into a second buffer. */
+    bool read_chunk(split_t* ma) {
+        if (ma->chunk_end_offset >= ma->split_end_offset) {
+            ma->release_chunk();
+            return false;
+        }
+        if (!ma->data && type_ == STDIO_READER)
+            ma->data = split_t::get_buffer();
+        size_t read_length = std::min(ma->kBufferSize,
+                ma->split_end_offset - ma->chunk_end_offset);
+        switch (type_) {
+            case STDIO_READER:
+                read_stdio(ma, read_length);
+                break;
+            case MMAP_READER:
+                ma->map_chunk(fileno(f_), ma->chunk_end_offset, read_length);
+                break;
+            case PREAD_READER:
+            case URING_READER:
+                read_pread(ma, read_length);
+                break;
+            default:
+                assert(0);
+        }
+        ma->chunk_start_offset = ma->chunk_end_offset;
+        ma->chunk_end_offset += read_length;
+        if ((type_ == PREAD_READER || type_ == URING_READER) &&
+                ma->chunk_end_offset < ma->split_end_offset)
+            start_prefetch(ma);
+        return true;
+    }
+
+  private:
+    // reads in flight at once; at most one per buffer in the pool
+    enum { kQueueDepth = 256 };
+    // offset and length alignment for O_DIRECT; the pool's buffers are
+    // aligned and have room for the partial blocks around a chunk
+    enum { kDirectAlign = split_t::kBufferAlign };
+
+    void read_stdio(split_t* ma, size_t read_length) {
+        pthread_mutex_lock(&flock_);
+        // seek to end of current chunk
+        fseek(f_, ma->chunk_end_offset, SEEK_SET);
+        // read in buffer
+        size_t ret = fread(ma->data, sizeof(char), read_length, f_);
+        pthread_mutex_unlock(&flock_);
+        if (ret != read_length) {
+            perror("fread");
+            assert(false);
+        }
+        // tokenizers built on strtok stop at the end of the chunk
+        ma->data[read_length] = 0;
+    }
+
+    void read_pread(split_t* ma, size_t read_length) {
+        if (!ma->data) {
+            // the first chunk; with a share of the pool free, this submits
+            // it (if it is not in flight yet) along with the next splits'
+            pthread_mutex_lock(&qlock_);
+            fill_ahead();
+            chunk_prefetch* a = take_ahead(ma->chunk_end_offset,
+                    read_length);
+            pthread_mutex_unlock(&qlock_);
+            if (a) {
+                wait_prefetch(a);
+                ma->data = a->data;
+                split_t::claim_ahead_buffer();
+                delete a;
+                pthread_mutex_lock(&qlock_);
+                fill_ahead();
+                pthread_mutex_unlock(&qlock_);
+                return;
+            }
+            ma->data = split_t::get_buffer();
+        }
+        chunk_prefetch* n = ma->next;
+        if (n && n->state != chunk_prefetch::IDLE &&
+                n->offset == ma->chunk_end_offset) {
+            wait_prefetch(n);
+            assert(n->length == read_length);
+            std::swap(ma->data, n->data);
+            n->state = chunk_prefetch::IDLE;
+            return;
+        }
+        read_span(ma->data, ma->chunk_end_offset, read_length);
+    }
+
+    /* @brief: the aligned file range covering the chunk of @n */
+    size_t span_start(const chunk_prefetch* n) const {
+        return n->offset - n->offset % align_;
+    }
+    size_t span_end(const chunk_prefetch* n) const {
+        return round_up(n->offset + n->length, align_);
+    }
+
+    /* @brief: move a chunk read with alignment to the front of its buffer
+     * and NUL terminate it */
+    void finish_span(char* buf, size_t off, size_t length) {
+        size_t delta = off % align_;
+        if (delta)
+            memmove(buf, buf + delta, length);
+        // tokenizers built on strtok stop at the end of the chunk
+        buf[length] = 0;
+    }
+
+    void read_span(char* buf, size_t off, size_t length) {
+        size_t start = off - off % align_;
+        size_t end = round_up(off + length, align_);
+        size_t done = 0;
+        while (start + done < off + length) {
+            // O_DIRECT reads past the end of the file come back short
+            ssize_t ret = pread(fd_, buf + done, end - start - done,
+                    start + done);
+            if (ret <= 0) {
+                perror("pread");
+                assert(false);
+            }
+            done += ret;
+        }
+        finish_span(buf, off, length);
+    }
+
+    /* @brief: queue a read of the chunk after the current one of @ma */
+    void start_prefetch(split_t* ma) {
+        chunk_prefetch* n = ma->next;
+        if (!n)
+            n = ma->next = new chunk_prefetch();
+        assert(n->state == chunk_prefetch::IDLE);
+        if (!n->data)
+            n->data = split_t::get_buffer();
+        n->offset = ma->chunk_end_offset;
+        n->length = std::min(ma->kBufferSize,
+                ma->split_end_offset - ma->chunk_end_offset);
+        n->done = 0;
+        n->state = chunk_prefetch::PENDING;
+
+        pthread_mutex_lock(&qlock_);
+        start_read(n);
+        pthread_mutex_unlock(&qlock_);
+    }
+
+    /* @brief: hand the read of @n to the ring or the prefetch thread.
+     * Requires qlock_. */
+    void start_read(chunk_prefetch* n) {
+        if (ring_) {
+            __atomic_add_fetch(&inflight_, 1, __ATOMIC_RELAXED);
+            submit(n);
+        } else {
+            if (!prefetcher_started_) {
+                int ret = pthread_create(&prefetcher_, NULL, prefetcher,
+                        this);
+                assert(ret == 0);
+                prefetcher_started_ = true;
+            }
+            queue_.push_back(n);
+            pthread_cond_signal(&qcond_);
+        }
+    }
+
+    /* @brief: start reading the first chunks noted by read_ahead(), in
+     * order, while the pool has buffers to spare for them. Requires
+     * qlock_. */
+    void fill_ahead() {
+        while (!planned_.empty()) {
+            char* b = split_t::get_ahead_buffer();
+            if (!b)
+                break;
+            chunk_prefetch* n = new chunk_prefetch();
+            n->data = b;
+            n->offset = planned_.front().first;
+            n->length = planned_.front().second;
+            n->state = chunk_prefetch::PENDING;
+            planned_.pop_front();
+            ahead_.push_back(n);
+            start_read(n);
+        }
+    }
+
+    /* @brief: the chunk at @off read ahead, or NULL if its read has not
+     * been started; it then won't be. Splits are mostly started in order,
+     * but thieves take them from the back. Requires qlock_. */
+    chunk_prefetch* take_ahead(size_t off, size_t length) {
+        for (size_t i = 0; i < ahead_.size(); ++i) {
+            chunk_prefetch* n = ahead_[i];
+            if (n->offset == off && n->length == length) {
+                ahead_.erase(ahead_.begin() + i);
+                return n;
+            }
+        }
+        for (size_t i = 0; i < planned_.size(); ++i) {
+            if (planned_[i].first == off && planned_[i].second == length) {
+                planned_.erase(planned_.begin() + i);
+                break;
+            }
+        }
+        return NULL;
+    }
+
+    void wait_prefetch(chunk_prefetch* n) {
+        while (__atomic_load_n(&n->state, __ATOMIC_ACQUIRE) ==
+                chunk_prefetch::PENDING) {
+            if (!ring_) {
+                futex_wait(&n->state, chunk_prefetch::PENDING);
+                continue;
+            }
+            // whoever holds rlock_ reaps for everybody
+            pthread_mutex_lock(&rlock_);
+            if (__atomic_load_n(&n->state, __ATOMIC_ACQUIRE) ==
+                    chunk_prefetch::PENDING)
+                reap_completions();
+            pthread_mutex_unlock(&rlock_);
+        }
+    }
+
+    /* @brief: submit the rest of the read of @n. Requires qlock_. */
+    void submit(chunk_prefetch* n) {
+        size_t start = span_start(n);
+        ring_->submit_read(fd_, n->data + n->done,
+                span_end(n) - start - n->done, start + n->done, n);
+    }
+
+    /* @brief: wait for reads to complete and mark them ready, resubmitting
+     * short reads. Requires rlock_. */
+    void reap_completions() {
+        void* data[32];
+        int res[32];
+        uint32_t nc = ring_->reap(data, res, 32);
+        for (uint32_t i = 0; i < nc; ++i) {
+            chunk_prefetch* n = (chunk_prefetch*)data[i];
+            if (res[i] <= 0) {
+                errno = -res[i];
+                perror("io_uring read");
+                assert(false);
+            }
+            n->done += res[i];
+            if (span_start(n) + n->done < n->offset + n->length) {
+                pthread_mutex_lock(&qlock_);
+                submit(n);
+                pthread_mutex_unlock(&qlock_);
+                continue;
+            }
+            finish_span(n->data, n->offset, n->length);
+            __atomic_sub_fetch(&inflight_, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&n->state, chunk_prefetch::READY,
+                    __ATOMIC_RELEASE);
+            futex_wake(&n->state, 1);
+        }
+    }
+
+    static void* prefetcher(void* arg) {
+        chunk_reader* r = (chunk_reader*)arg;
+        while (true) {
+            pthread_mutex_lock(&r->qlock_);
+            while (r->queue_.empty() && !r->stop_)
+                pthread_cond_wait(&r->qcond_, &r->qlock_);
+            if (r->queue_.empty()) {
+                pthread_mutex_unlock(&r->qlock_);
+                break;
+            }
+            chunk_prefetch* n = r->queue_.front();
+            r->queue_.pop_front();
+            pthread_mutex_unlock(&r->qlock_);
+
+            r->read_span(n->data, n->offset, n->length);
+            __atomic_store_n(&n->state, chunk_prefetch::READY,
+                    __ATOMIC_RELEASE);
+            futex_wake(&n->state, 1);
+        }
+        return NULL;
+    }
+
+    static reader_t& default_type() {
+        static reader_t t = STDIO_READER;
+        return t;
+    }
+    static bool& default_direct() {
+        static bool d = false;
+        return d;
+    }
+
+    reader_t type_;
+    FILE* f_;
+    // serializes the shared FILE* of the stdio reader
+    pthread_mutex_t flock_;
+    size_t size_;
+    // descriptor for pread and io_uring; opened separately for O_DIRECT
+    int fd_;
+    size_t align_;
+
+    // background reads for the pread reader
+    pthread_t prefetcher_;
+    bool prefetcher_started_;
+    bool stop_;
+    std::deque<chunk_prefetch*> queue_;
+    pthread_mutex_t qlock_;
+    pthread_cond_t qcond_;
+
+    // first chunks of the splits, as (offset, length), still to be read
+    // ahead, and those being or already read ahead; both in split order
+    // and guarded by qlock_
+    std::deque<std::pair<size_t, size_t> > planned_;
+    std::deque<chunk_prefetch*> ahead_;
+
+    // background reads for the uring reader; qlock_ serializes
+    // submissions and rlock_ completions
+    uring* ring_;
+    pthread_mutex_t rlock_;
+    uint32_t inflight_;
+};
+
+#endif  // CHUNK_READER_HH_
@@ -0,0 +1,103 @@
+#ifndef COMBINER_HH_
+#define COMBINER_HH_ 1
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "appbase.hh"
+#include "PartialAgg.h"
+
+/* @brief: Small direct-mapped cache of PAOs that sits in front of
+ * map_manager::emit() on one map core. A record whose key is already cached
+ * is merged into the cached PAO with Operations::merge(); otherwise it
+ * replaces the cached entry, which is emitted to the manager. Hot keys are
+ * thus handed to the aggregators once per eviction instead of once per
+ * occurrence. flush() must be called before the core's last
+ * flush_buffered_paos(). Single-threaded. */
+struct map_combiner {
+    map_combiner(const Operations* ops, uint32_t nslots) :
+            ops_(ops), mask_(0), log_nslots_(0), scratch_(NULL),
+            nemits_(0), ncombined_(0) {
+        uint32_t n = 2;
+        while (n < nslots)
+            n <<= 1;
+        mask_ = n - 1;
+        log_nslots_ = __builtin_ctz(n);
+        slots_ = new entry[n];
+        for (uint32_t i = 0; i < n; ++i)
+            ops_->createPAO(NULL, &slots_[i].pao);
+        ops_->createPAO(NULL, &scratch_);
+    }
+    ~map_combiner() {
+        for (uint32_t i = 0; i <= mask_; ++i)
+            ops_->destroyPAO(slots_[i].pao);
+        delete[] slots_;
+        ops_->destroyPAO(scratch_);
+    }
+
+    void emit(map_manager* m, void* k, void* v, size_t keylen,
+            unsigned hash, bool view) {
+        ++nemits_;
+        if (view)
+            ops_->setKeyView(scratch_, (const char*)k, keylen);
+        else
+            ops_->setKey(scratch_, (char*)k);
+        ops_->setValue(scratch_, v);
+        entry& e = slots_[(hash * 0x9e3779b9u) >> (32 - log_nslots_)];
+        if (e.used && e.hash == hash && e.keylen == keylen &&
+                ops_->sameKey(e.pao, scratch_)) {
+            ops_->merge(e.pao, scratch_);
+            ++ncombined_;
+            return;
+        }
+        if (e.used)
+            evict(m, e);
+        // the scratch PAO already holds the new record
+        PartialAgg* p = e.pao;
+        e.pao = scratch_;
+        scratch_ = p;
+        e.hash = hash;
+        e.keylen = keylen;
+        e.used = true;
+    }
+
+    /* @brief: hand every cached entry to the manager */
+    void flush(map_manager* m) {
+        for (uint32_t i = 0; i <= mask_; ++i)
+            if (slots_[i].used)
+                evict(m, slots_[i]);
+    }
+
+    uint64_t num_emits() const {
+        return nemits_;
+    }
+    uint64_t num_combined() const {
+        return ncombined_;
+    }
+
+  private:
+    struct entry {
+        entry() : pao(NULL), hash(0), keylen(0), used(false) {}
+        PartialAgg* pao;
+        unsigned hash;
+        size_t keylen;
+        bool used;
+    };
+
+    void evict(map_manager* m, entry& e) {
+        m->emit((void*)ops_->getKey(e.pao), ops_->getValue(e.pao), e.keylen,
+                e.hash, false);
+        e.used = false;
+    }
+
+    const Operations* ops_;
+    entry* slots_;
+    uint32_t mask_;
+    uint32_t log_nslots_;
+    PartialAgg* scratch_;
+    uint64_t nemits_;
+    uint64_t ncombined_;
+};
+
+#endif  // COMBINER_HH_
@@ -0,0 +1,134 @@
+#ifndef COUNT_OPS_HH_
+#define COUNT_OPS_HH_ 1
+
+#include <assert.h>
+#include <inttypes.h>
+
+#include "key_traits.hh"
+#include "PartialAgg.h"
+
+template <typename K, typename V> class CountOperations;
+
+/* A fixed-width key (see key_traits.hh) and a count or sum of type V.
+ * Fixed-size and self-contained, so it can live inline in the fixed-key
+ * tables. */
+template <typename K, typename V = uint32_t>
+class CountPAO : public PartialAgg
+{
+    friend class CountOperations<K, V>;
+  public:
+    CountPAO() : key(), count(1) {
+    }
+    ~CountPAO() {
+    }
+  private:
+    K key;
+    V count;
+};
+
+/* Operations for jobs that add up a value per fixed-width key, such as
+ * k-mer counts or histograms. Keys are the sizeof(K) bytes of a K, both for
+ * setKey() and for setKeyView(), as emitted by map_emit_key(); values are
+ * passed as integers cast to void*. */
+template <typename K, typename V = uint32_t>
+class CountOperations : public Operations {
+    typedef CountPAO<K, V> pao;
+  public:
+    Operations::SerializationMethod getSerializationMethod() const {
+        return Operations::HAND;
+    }
+
+    const char* getKey(PartialAgg* p) const {
+        return (const char*)&((pao*)p)->key;
+    }
+
+    bool setKey(PartialAgg* p, char* k) const {
+        ((pao*)p)->key = key_traits<K>::load(k);
+        return true;
+    }
+
+    bool setKeyView(PartialAgg* p, const char* k, size_t len) const {
+        assert(len == sizeof(K));
+        ((pao*)p)->key = key_traits<K>::load(k);
+        return true;
+    }
+
+    void* getValue(PartialAgg* p) const {
+        return (void*)(intptr_t)((pao*)p)->count;
+    }
+
+    void setValue(PartialAgg* p, void* v) const {
+        ((pao*)p)->count = (intptr_t)v;
+    }
+
+    bool sameKey(PartialAgg* p1, PartialAgg* p2) const {
+        return key_traits<K>::equal(((pao*)p1)->key, ((pao*)p2)->key);
+    }
+
+    size_t createPAO(Token* t, PartialAgg** p) const {
+        p[0] = new pao();
+        return 1;
+    }
+
+    bool destroyPAO(PartialAgg* p) const {
+        delete (pao*)p;
+        return true;
+    }
+
+    size_t paoSize() const {
+        return sizeof(pao);
+    }
+
+    PartialAgg* constructPAO(void* mem) const {
+        return new(mem) pao();
+    }
+
+    void destructPAO(PartialAgg* p) const {
+        ((pao*)p)->~pao();
+    }
+
+    bool arenaAllocatable() const {
+        return true;
+    }
+
+    size_t keySize() const {
+        return sizeof(K);
+    }
+
+    bool merge(PartialAgg* p, PartialAgg* mg) const {
+        ((pao*)p)->count += ((pao*)mg)->count;
+        return true;
+    }
+
+    inline uint32_t getSerializedSize(PartialAgg* p) const {
+        return sizeof(K) + sizeof(V);
+    }
+
+    inline bool serialize(PartialAgg* p,
+            std::string* output) const {
+        return true;
+    }
+
+    inline bool serialize(PartialAgg* p,
+            char* output, size_t size) const {
+        pao* cp = (pao*)p;
+        memcpy(output, &cp->count, sizeof(V));
+        memcpy(&output[sizeof(V)], &cp->key, sizeof(K));
+        return true;
+    }
+
+    inline bool deserialize(PartialAgg* p,
+            const std::string& input) const {
+        return true;
+    }
+
+    inline bool deserialize(PartialAgg* p,
+            const char* input, size_t size) const {
+        pao* cp = (pao*)p;
+        memcpy(&cp->count, input, sizeof(V));
+        memcpy(&cp->key, &input[sizeof(V)], sizeof(K));
+        return true;
+    }
+};
+
+#endif  // COUNT_OPS_HH_
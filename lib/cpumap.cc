@@ -13,12 +13,14 @@
  * binding.
  */
 #include "lib/cpumap.hh"
+#include "lib/topology.hh"
 
 static int logical_to_physical_[JOS_NCPU];
 
 void cpumap_init() {
+    const topology& t = topology::get();
     for (int i = 0; i < JOS_NCPU; ++i)
-	logical_to_physical_[i] = i;
+	logical_to_physical_[i] = t.worker_cpu(i);
 }
 
 int cpumap_physical_cpuid(int i) {
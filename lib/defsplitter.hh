@@ -19,25 +19,21 @@
 #include <algorithm>
 #include <ctype.h>
 #include "mr-types.hh"
+#include "chunk_reader.hh"
 #include <asm/mman.h>
 
 struct defsplitter {
     defsplitter(char *d, size_t size, size_t nsplit)
-        : d_(d), size_(size), nsplit_(nsplit), pos_(0) {
+        : r_(NULL), d_(d), size_(size), nsplit_(nsplit), pos_(0),
+          guided_(nsplit == 0) {
     }
     defsplitter(const char *f, size_t nsplit) :
-            f_(NULL), nsplit_(nsplit), pos_(0) {
-        f_ = fopen(f, "r");
-        assert(f_);
-        fseek(f_, 0, SEEK_END);
-        size_ = ftell(f_);
-        rewind(f_);
-
-        pthread_mutex_init(&flock_, NULL);
+            r_(new chunk_reader(f)), nsplit_(nsplit), pos_(0),
+            guided_(nsplit == 0) {
+        size_ = r_->size();
     }
     ~defsplitter() {
-        fclose(f_);
-        pthread_mutex_destroy(&flock_);
+        delete r_;
     }
     int prefault() {
         int sum = 0;
@@ -52,32 +48,17 @@ struct defsplitter {
     }
 
   private:
-    FILE* f_;
-    pthread_mutex_t flock_;
+    chunk_reader* r_;
     char *d_;
     size_t size_;
     int nsplit_;
     size_t pos_;
+    // shrink the splits towards the end unless the caller chose nsplit
+    const bool guided_;
 };
 
 bool defsplitter::get_split_chunk(split_t* ma) {
-    if (ma->chunk_end_offset >= ma->split_end_offset)
-        return false;
-    pthread_mutex_lock(&flock_);
-    // seek to end of current chunk
-    fseek(f_, ma->chunk_end_offset, SEEK_SET);
-    // read in buffer
-    size_t read_length = std::min(ma->kBufferSize,
-            ma->split_end_offset - ma->chunk_end_offset);
-    size_t ret = fread(ma->data, sizeof(char), read_length, f_);
-    pthread_mutex_unlock(&flock_);
-    if (ret != read_length) {
-        perror("fread");
-        assert(false);
-    }
-    ma->chunk_start_offset = ma->chunk_end_offset;
-    ma->chunk_end_offset += read_length;
-    return true;
+    return r_->read_chunk(ma);
 }
 
 bool defsplitter::split(split_t *ma, int ncores, const char *stop, size_t align) {
@@ -89,14 +70,18 @@ bool defsplitter::split(split_t *ma, int ncores, const char *stop, size_t align)
         nsplit_ = std::min(max, ncores * def_nsplits_per_core);
     if (pos_ >= size_)
         return false;
-    size_t length = std::min(size_ - pos_, size_ / nsplit_);
+    size_t length = guided_ ?
+        guided_split_length(size_ - pos_, size_ / nsplit_, ncores) :
+        std::min(size_ - pos_, size_ / nsplit_);
 //    if (length < size_ - pos_)
 //        length = round_up(length, 4096); 
 
     ma->split_start_offset = ma->chunk_start_offset = ma->chunk_end_offset = pos_;
     ma->split_end_offset = pos_ + length;
-
-    get_split_chunk(ma);
+    // the chunks are loaded by get_split_chunk() in the map phase
+    ma->from_file = true;
+    if (r_)
+        r_->read_ahead(ma);
     pos_ += length;
     return true;
 }
@@ -0,0 +1,164 @@
+#ifndef FIXED_KEY_TABLE_HH_
+#define FIXED_KEY_TABLE_HH_ 1
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.hh"
+#include "key_traits.hh"
+#include "PartialAgg.h"
+
+/* @brief: Open-addressing table from fixed-width keys of type K (e.g.
+ * packed k-mers) to PAOs. The PAOs live inline in the slots, so a key
+ * costs one slot of paoSize() bytes plus a bit of occupancy, and a probe
+ * compares the key straight out of the PAO with key_traits<K>::equal().
+ * Requires fixed-size PAOs that keep their key at a fixed offset (the
+ * bytes getKey() points at) and can be moved with memcpy, which is how the
+ * table grows. Keys are placed by key_traits<K>::hash(), which the table
+ * computes itself on insertion and on growth. Linear probing, no erase.
+ * Single writer. */
+template <typename K>
+struct fixed_key_table {
+    typedef key_traits<K> traits;
+
+    explicit fixed_key_table(const Operations* ops,
+            uint32_t min_capacity = 1024) :
+            ops_(ops), stride_(round_up(ops->paoSize(), sizeof(uint64_t))),
+            key_offset_(0), slots_(NULL), used_(NULL), log_capacity_(0),
+            size_(0) {
+        assert(ops_->paoSize() && ops_->arenaAllocatable());
+        assert(ops_->keySize() == sizeof(K));
+        // where the key sits in a PAO
+        char* mem = (char*)malloc(stride_);
+        PartialAgg* p = ops_->constructPAO(mem);
+        key_offset_ = ops_->getKey(p) - mem;
+        ops_->destructPAO(p);
+        free(mem);
+        assert(key_offset_ + sizeof(K) <= ops_->paoSize());
+
+        uint32_t log_capacity = 6;
+        while ((1ULL << log_capacity) < min_capacity)
+            ++log_capacity;
+        alloc(log_capacity);
+    }
+    ~fixed_key_table() {
+        free(slots_);
+        free(used_);
+    }
+
+    /* @brief: the PAO for @key. If there is none, an empty PAO is
+     * constructed for it and @found is false; the caller must then set its
+     * key and value. The PAO stays where it is until the next insertion of
+     * a new key. */
+    PartialAgg* find_or_insert(const K& key, bool& found) {
+        uint32_t hash = traits::hash(key);
+        uint64_t i = probe(key, hash, found);
+        if (found)
+            return at(i);
+        if (size_ >= max_load()) {
+            grow();
+            i = probe(key, hash, found);
+        }
+        used_[i >> 6] |= 1ULL << (i & 63);
+        ++size_;
+        return ops_->constructPAO(slots_ + i * stride_);
+    }
+
+    /* @brief: drop all entries. As for an arena, the PAOs are not
+     * destructed. */
+    void clear() {
+        memset(used_, 0, capacity() / 8);
+        size_ = 0;
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+    uint64_t capacity() const {
+        return 1ULL << log_capacity_;
+    }
+    /* @brief: bytes held by the slots and the occupancy bits */
+    uint64_t memory() const {
+        return capacity() * stride_ + capacity() / 8;
+    }
+    /* @brief: for iteration over slots [0, capacity()) */
+    bool used(uint64_t i) const {
+        return (used_[i >> 6] >> (i & 63)) & 1;
+    }
+    PartialAgg* at(uint64_t i) {
+        return (PartialAgg*)(slots_ + i * stride_);
+    }
+
+  private:
+    K key_at(const char* slot) const {
+        return traits::load(slot + key_offset_);
+    }
+    // the partition fixes the low bits of the emit hash, which is usually
+    // this hash, so spread all of them over the slot index
+    uint64_t home(uint32_t hash) const {
+        return (hash * 0x9e3779b9u) >> (32 - log_capacity_);
+    }
+    uint64_t max_load() const {
+        return capacity() / 4 * 3;
+    }
+
+    /* @brief: returns the slot holding @key, or the first free slot after
+     * its home */
+    uint64_t probe(const K& key, uint32_t hash, bool& found) const {
+        uint64_t mask = capacity() - 1;
+        for (uint64_t i = home(hash); ; i = (i + 1) & mask) {
+            if (!used(i)) {
+                found = false;
+                return i;
+            }
+            if (traits::equal(key_at(slots_ + i * stride_), key)) {
+                found = true;
+                return i;
+            }
+        }
+    }
+
+    void alloc(uint32_t log_capacity) {
+        assert(log_capacity <= 32);
+        log_capacity_ = log_capacity;
+        int ret = posix_memalign((void**)&slots_, JOS_CLINE,
+                capacity() * stride_);
+        assert(ret == 0);
+        ret = posix_memalign((void**)&used_, JOS_CLINE, capacity() / 8);
+        assert(ret == 0);
+        memset(used_, 0, capacity() / 8);
+    }
+
+    /* @brief: double the table, moving the PAOs over by their keys */
+    void grow() {
+        char* old_slots = slots_;
+        uint64_t* old_used = used_;
+        uint64_t old_cap = capacity();
+        alloc(log_capacity_ + 1);
+        uint64_t mask = capacity() - 1;
+        for (uint64_t i = 0; i < old_cap; ++i) {
+            if (!((old_used[i >> 6] >> (i & 63)) & 1))
+                continue;
+            const char* o = old_slots + i * stride_;
+            uint64_t j = home(traits::hash(key_at(o)));
+            while (used(j))
+                j = (j + 1) & mask;
+            used_[j >> 6] |= 1ULL << (j & 63);
+            memcpy(slots_ + j * stride_, o, stride_);
+        }
+        free(old_slots);
+        free(old_used);
+    }
+
+    const Operations* ops_;
+    const size_t stride_;
+    size_t key_offset_;
+    char* slots_;
+    uint64_t* used_;
+    uint32_t log_capacity_;
+    uint64_t size_;
+};
+
+#endif  // FIXED_KEY_TABLE_HH_
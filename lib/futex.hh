@@ -0,0 +1,30 @@
+#ifndef FUTEX_HH_
+#define FUTEX_HH_ 1
+
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* @brief: sleep while *addr == val, or until @timeout_ms passes (0 waits
+ * forever). Returns early on wakeups, signals and spurious wakeups, so
+ * callers must re-check their condition. */
+inline void futex_wait(int *addr, int val, uint32_t timeout_ms = 0) {
+    struct timespec ts;
+    struct timespec* tp = NULL;
+    if (timeout_ms) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        tp = &ts;
+    }
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tp, NULL, 0);
+}
+
+/* @brief: wake up to @n threads sleeping on addr */
+inline void futex_wake(int *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#endif  // FUTEX_HH_
@@ -0,0 +1,45 @@
+#ifndef HASHED_KEY_HH_
+#define HASHED_KEY_HH_ 1
+
+#include <inttypes.h>
+#include <string.h>
+
+/* @brief: A string key together with the hash and length computed for it
+ * in map_emit(), so that hash tables can use them instead of calling
+ * strlen and hashing the key again. Both describe the key as setKey()
+ * stored it (see Operations::maxKeyLength()), which is what @key points
+ * at. */
+struct hashed_key {
+    hashed_key() : key(NULL), hash(0), len(0) {}
+    hashed_key(const char* k, uint32_t h, uint32_t l) :
+            key(k), hash(h), len(l) {}
+
+    /* @brief: the emit hash with its bits mixed down. Keys are partitioned
+     * by hash % #partitions, which fixes the low bits a table would index
+     * by. */
+    size_t mixed_hash() const {
+        uint32_t h = hash;
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        return h;
+    }
+    bool operator==(const hashed_key& o) const {
+        return hash == o.hash && len == o.len && key && o.key &&
+                strcmp(key, o.key) == 0;
+    }
+
+    // mutable so that a table can point an entry at an equal copy of its
+    // key, e.g. once the key it was probed with is copied into a new PAO
+    mutable const char* key;
+    uint32_t hash;
+    uint32_t len;
+};
+
+struct hashed_key_hasher {
+    size_t operator()(const hashed_key& k) const {
+        return k.mixed_hash();
+    }
+};
+
+#endif  // HASHED_KEY_HH_
@@ -0,0 +1,46 @@
+#ifndef KEY_TRAITS_HH_
+#define KEY_TRAITS_HH_ 1
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "HashUtil.h"
+
+/* @brief: How keys of the fixed-width type K are hashed and compared by
+ * map_emit_key() and the fixed-key backends (see map_fixed_manager),
+ * resolved at compile time. The default works on the bytes of the key:
+ * keys of up to 8 bytes (integers, packed k-mers) are hashed with
+ * HashUtil::hashint64(), wider ones (binary_key) with MurmurHash. As it
+ * only looks at the bytes, a key may be emitted as one type (e.g. int32_t)
+ * and aggregated as another of the same width (the u32 backend).
+ * Specialize it for key types whose bytes are not all significant, add()
+ * a backend for that type with its key width (see create_fixed_manager())
+ * and select it with set_backend(). */
+template <typename K>
+struct key_traits {
+    static uint32_t hash(const K& k) {
+        if (sizeof(K) <= sizeof(uint64_t)) {
+            uint64_t v = 0;
+            memcpy(&v, &k, sizeof(K));
+            return HashUtil::hashint64(v);
+        }
+        return HashUtil::MurmurHash(&k, sizeof(K), 42);
+    }
+    static bool equal(const K& a, const K& b) {
+        return memcmp(&a, &b, sizeof(K)) == 0;
+    }
+    /* @brief: the key whose bytes start at @p, which need not be aligned */
+    static K load(const char* p) {
+        K k;
+        memcpy(&k, p, sizeof(K));
+        return k;
+    }
+};
+
+/* @brief: an opaque key of @N bytes, e.g. a digest */
+template <size_t N>
+struct binary_key {
+    char bytes[N];
+};
+
+#endif  // KEY_TRAITS_HH_
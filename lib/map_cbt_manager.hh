@@ -5,15 +5,17 @@
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <vector>
-#include <deque>
 
 #include "array.hh"
 #include "test_util.hh"
 #include "appbase.hh"
 #include "bufferpool.hh"
+#include "thread.hh"
 #include "threadinfo.hh"
+#include "topology.hh"
 #include "CompressTree.h"
 #include "HashUtil.h"
+#include "mpsc_queue.hh"
 #include "PartialAgg.h"
 
 using namespace google::protobuf::io;
@@ -25,14 +27,23 @@ struct map_cbt_manager : public map_manager {
     map_cbt_manager();
     ~map_cbt_manager();
     void init(Operations* ops, uint32_t ncore, uint32_t ntree);
-    bool emit(void *key, void *val, size_t keylen, unsigned hash);
+    bool emit(void *key, void *val, size_t keylen, unsigned hash,
+            bool view);
     void flush_buffered_paos();
     void finish_phase(int phase);
     void finalize();
+    uint32_t num_finalize_workers() const {
+        return ntree_ * 2;
+    }
+    bool can_stream_finalize() const {
+        return true;
+    }
     bool get_paos(PartialAgg** buf, uint64_t& num_read, uint64_t max);
   private:
     static void *worker(void *arg);
     static void *random_input_worker(void *arg);
+    // reads one tree out into results_, using a buffer from @shard
+    void finalize_tree(uint32_t treeid, uint32_t shard);
     void submit_array(uint32_t treeid, PAOArray* buf);
 
   private:
@@ -44,13 +55,13 @@ struct map_cbt_manager : public map_manager {
 
     // buffer pool
     PAOArray** buffered_paos_;
-    bufferpool* bufpool_;
+    numa_bufferpool* bufpool_;
 
-    // threads for insertion into CBTs
-    pthread_t* tid_;
-    pthread_mutex_t* cbt_queue_mutex_;
-    pthread_cond_t* cbt_queue_empty_;
-    std::vector<std::deque<PAOArray*>*> cbt_queue_;    
+    // pooled threads for insertion into CBTs (see mthread_create_aux)
+    int* tid_;
+    std::vector<mpsc_queue<PAOArray*>*> cbt_queue_;
+    // serializes the finalize workers reading out the same tree
+    pthread_mutex_t* cbt_read_mutex_;
 };
 
 map_cbt_manager::map_cbt_manager() :
@@ -59,7 +70,6 @@ map_cbt_manager::map_cbt_manager() :
 } 
 
 map_cbt_manager::~map_cbt_manager() {
-    sem_destroy(&phase_semaphore_);
     // clean up buffers
     delete[] buffered_paos_;
     delete bufpool_;
@@ -67,12 +77,11 @@ map_cbt_manager::~map_cbt_manager() {
     // clean up CBTs
     for (uint32_t j = 0; j < ntree_; ++j) {
         delete cbt_[j];
-        pthread_mutex_destroy(&cbt_queue_mutex_[j]);
-        pthread_cond_destroy(&cbt_queue_empty_[j]);
+        delete cbt_queue_[j];
+        pthread_mutex_destroy(&cbt_read_mutex_[j]);
     }
     delete[] cbt_;
-    delete[] cbt_queue_mutex_;
-    delete[] cbt_queue_empty_;
+    delete[] cbt_read_mutex_;
 }
 
 void map_cbt_manager::init(Operations* ops, uint32_t ncore, uint32_t ntree) {
@@ -82,56 +91,43 @@ void map_cbt_manager::init(Operations* ops, uint32_t ncore, uint32_t ntree) {
 
     // create CBTs
     cbt_ = new cbt::CompressTree*[ntree_];
-    cbt_queue_mutex_ = new pthread_mutex_t[ntree_];
-    cbt_queue_empty_ = new pthread_cond_t[ntree_];
+    cbt_read_mutex_ = new pthread_mutex_t[ntree_];
 
     uint32_t fanout = 64;
     uint32_t buffer_size = 31457280; //125829120
     uint32_t pao_size = 64;
+    const topology& topo = topology::get();
     for (uint32_t j = 0; j < ntree_; ++j) {
+        // on the node of the tree's aggregator
+        numa_preferred on(topo.home_node(j, ntree_));
         cbt_[j] = new cbt::CompressTree(2, fanout, 1000, buffer_size,
                 pao_size, ops_);
-        pthread_mutex_init(&cbt_queue_mutex_[j], NULL);
-        pthread_cond_init(&cbt_queue_empty_[j], NULL);
+        pthread_mutex_init(&cbt_read_mutex_[j], NULL);
 
-        std::deque<PAOArray*>* d = new std::deque<PAOArray*>();
-        cbt_queue_.push_back(d);
+        // a queue never holds more than the whole buffer pool; every map
+        // worker is a producer
+        cbt_queue_.push_back(new mpsc_queue<PAOArray*>(ncore_ * ntree_ * 3,
+                ncore_));
     }
 
     // set up workers for insertion into CBTs
-    tid_ = new pthread_t[ntree_];
-    // sending two arguments to workers
-    std::vector<args_struct*> args;
-
+    tid_ = new int[ntree_];
     // create a pool of buffers
-    bufpool_ = new bufferpool(ops_, kInsertAtOnce, ncore_ * ntree_ * 3);
+    bufpool_ = new numa_bufferpool(ops_, kInsertAtOnce, ncore_ * 3, ntree_,
+            ncore_);
     buffered_paos_ = new PAOArray*[ncore_ * ntree_];
     for (uint32_t j = 0; j < ncore_ * ntree_; ++j) {
-        buffered_paos_[j] = bufpool_->get_buffer();
+        buffered_paos_[j] = bufpool_->get_buffer(j % ntree_, j / ntree_);
     }
 
-    // set all cpus in cpu mask
-    cpu_set_t cset1, cset2;
-    CPU_ZERO(&cset1);
-    CPU_ZERO(&cset2);
-    for (uint32_t i = 4; i < 6; ++i)
-        CPU_SET(i, &cset1);
-    for (uint32_t i = 12; i < 18; ++i)
-        CPU_SET(i, &cset1);
-    for (uint32_t i = 6; i < 12; ++i)
-        CPU_SET(i, &cset2);
-    for (uint32_t i = 18; i < 24; ++i)
-        CPU_SET(i, &cset2);
+    // place the aggregators by the topology policy
     for (uint32_t j = 0; j < ntree_; ++j) {
+        cpu_set_t cset;
+        topo.aggregator_cpus(j, ntree_, ncore_, &cset);
         args_struct* a = new args_struct(2);
         a->argv[0] = (void*)this;
         a->argv[1] = (void*)((intptr_t)j);
-        args.push_back(a);
-        pthread_create(&tid_[j], NULL, worker, a);
-        if (j < ntree_ / 2)
-            pthread_setaffinity_np(tid_[j], sizeof(cpu_set_t), &cset1);
-        else
-            pthread_setaffinity_np(tid_[j], sizeof(cpu_set_t), &cset2);
+        tid_[j] = mthread_create_aux(worker, a, &cset);
     }
 
     // results mutex
@@ -140,27 +136,25 @@ void map_cbt_manager::init(Operations* ops, uint32_t ncore, uint32_t ntree) {
 }
 
 void map_cbt_manager::submit_array(uint32_t treeid, PAOArray* buf) {
-    pthread_mutex_lock(&cbt_queue_mutex_[treeid]);
-    cbt_queue_[treeid]->push_back(buf);
-    pthread_cond_signal(&cbt_queue_empty_[treeid]);
-    pthread_mutex_unlock(&cbt_queue_mutex_[treeid]);
-    num_inserted_ += buf->index();
+    __sync_fetch_and_add(&num_inserted_, buf->index());
+    cbt_queue_[treeid]->push(buf);
 }
 
-bool map_cbt_manager::emit(void *k, void *v, size_t keylen, unsigned hash) {
+bool map_cbt_manager::emit(void *k, void *v, size_t keylen, unsigned hash,
+        bool view) {
     uint32_t treeid = hash % ntree_;
-    uint32_t coreid = threadinfo::current()->cur_core_;
-    uint32_t bufid = coreid * ntree_ + treeid;
-    PAOArray* buf = buffered_paos_[bufid];
+    PAOArray** slots = core_slots(buffered_paos_, ntree_);
+    PAOArray* buf = slots[treeid];
     uint32_t ind = buf->index();
-    ops()->setKey(buf->list()[ind], (char*)k);
+    set_key(buf->list()[ind], k, keylen, view);
     ops()->setValue(buf->list()[ind], v);
     buf->set_index(ind + 1);
 
     if (buf->index() == kInsertAtOnce) {
         submit_array(treeid, buf);
         // get new buffer from pool
-        buffered_paos_[bufid] = bufpool_->get_buffer();
+        slots[treeid] = bufpool_->get_buffer(treeid,
+                threadinfo::current()->cur_core_);
     }
 //    fprintf(stderr, "[%ld], inserted at %d\n", pthread_self(), ind);
     return true;
@@ -172,6 +166,7 @@ void map_cbt_manager::flush_buffered_paos() {
         uint32_t bufid = coreid * ntree_ + treeid;
         PAOArray* buf = buffered_paos_[bufid];
         submit_array(treeid, buf);
+        cbt_queue_[treeid]->producer_done();
     }
 }
 
@@ -179,8 +174,9 @@ void map_cbt_manager::finish_phase(int phase) {
     switch (phase) {
         case MAP:
             for (uint32_t treeid = 0; treeid < ntree_; ++treeid) {
-                pthread_join(tid_[treeid], NULL);
+                mthread_join_aux(tid_[treeid]);
             }
+            bufpool_->print_stats(stderr);
             break;
         case FINALIZE:
             break;
@@ -193,51 +189,40 @@ void* map_cbt_manager::worker(void *x) {
     args_struct* a = (args_struct*)x;
     map_cbt_manager* m = (map_cbt_manager*)(a->argv[0]);
     uint32_t treeid = (intptr_t)(a->argv[1]);
-    std::deque<PAOArray*>* q = m->cbt_queue_[treeid];
+    delete a;
+    mpsc_queue<PAOArray*>* q = m->cbt_queue_[treeid];
     cpu_set_t cset;
     pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
 
-    while (true) {
-        pthread_mutex_lock(&m->cbt_queue_mutex_[treeid]);
-        pthread_cond_wait(&m->cbt_queue_empty_[treeid],
-                &m->cbt_queue_mutex_[treeid]);
-        pthread_mutex_unlock(&m->cbt_queue_mutex_[treeid]);
-
-        while (!q->empty()) {
-            // remove array from queue
-            pthread_mutex_lock(&m->cbt_queue_mutex_[treeid]);
-            PAOArray* buf = q->front();
-            q->pop_front();
-            pthread_mutex_unlock(&m->cbt_queue_mutex_[treeid]);
-
-            // perform insertion
-            m->cbt_[treeid]->bulk_insert(buf->list(), buf->index());
-
-            // return buffer to pool
-            m->bufpool_->return_buffer(buf);
-        }
-
-        int ret;
-        sem_getvalue(&m->phase_semaphore_, &ret);
-        if (ret == (int)m->ncore_)
-            break;
+    PAOArray* buf;
+    // returns false once every map worker has flushed its last buffer
+    while (q->pop(buf)) {
+        // perform insertion
+        m->cbt_[treeid]->bulk_insert(buf->list(), buf->index());
+
+        // return buffer to pool
+        m->bufpool_->return_buffer(treeid, buf);
     }
     fprintf(stderr, "Num inserted: %ld\n", m->num_inserted_);
+    if (m->stream_finalize_)
+        m->finalize_tree(treeid, treeid % m->ncore_);
     return 0;
 }
 
 void map_cbt_manager::finalize() {
     uint32_t coreid = threadinfo::current()->cur_core_;
-    uint32_t treeid = coreid % ntree_;
+    finalize_tree(coreid % ntree_, coreid % ncore_);
+}
 
-    PAOArray* buf = bufpool_->get_buffer();
+void map_cbt_manager::finalize_tree(uint32_t treeid, uint32_t shard) {
+    PAOArray* buf = bufpool_->get_buffer(treeid, shard);
     uint64_t num_read;
     bool remain;
     do {
-        pthread_mutex_lock(&cbt_queue_mutex_[treeid]);
+        pthread_mutex_lock(&cbt_read_mutex_[treeid]);
         remain = cbt_[treeid]->bulk_read(buf->list(), num_read,
                 kInsertAtOnce);
-        pthread_mutex_unlock(&cbt_queue_mutex_[treeid]);
+        pthread_mutex_unlock(&cbt_read_mutex_[treeid]);
 
         // copy results
         pthread_mutex_lock(&results_mutex_);
@@ -252,10 +237,10 @@ bool map_cbt_manager::get_paos(PartialAgg** buf, uint64_t& num_read,
     uint32_t coreid = threadinfo::current()->cur_core_;
     uint32_t treeid = coreid % ntree_;
 
-    pthread_mutex_lock(&cbt_queue_mutex_[treeid]);
+    pthread_mutex_lock(&cbt_read_mutex_[treeid]);
     bool remain = cbt_[treeid]->bulk_read(buf, num_read,
             max);
-    pthread_mutex_unlock(&cbt_queue_mutex_[treeid]);
+    pthread_mutex_unlock(&cbt_read_mutex_[treeid]);
     return remain;
 }
 
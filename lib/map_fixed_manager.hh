@@ -0,0 +1,299 @@
+#ifndef MAP_FIXED_MANAGER_HH_
+#define MAP_FIXED_MANAGER_HH_ 1
+
+#include <inttypes.h>
+#include <vector>
+
+#include "appbase.hh"
+#include "bufferpool.hh"
+#include "thread.hh"
+#include "threadinfo.hh"
+#include "topology.hh"
+#include "mpsc_queue.hh"
+#include "fixed_key_table.hh"
+#include "PartialAgg.h"
+
+struct args_struct;
+
+/* @brief: A map manager for fixed-width keys of type K, emitted with
+ * map_emit_key(), using tables that hold the PAOs inline (see
+ * fixed_key_table). Partitioned and threaded like map_oa_manager: keys go
+ * to a table by their emit-time hash, and every table is filled by its own
+ * aggregator thread. Needs Operations with fixed-size, arena-allocatable
+ * PAOs and a keySize() of sizeof(K). The u32 and u64 backends are built
+ * in; register others with create_fixed_manager(). */
+template <typename K>
+struct map_fixed_manager : public map_manager {
+    map_fixed_manager();
+    ~map_fixed_manager();
+    void init(Operations* ops, uint32_t ncore, uint32_t ntables);
+    bool emit(void *key, void *val, size_t keylen, unsigned hash,
+            bool view);
+    void flush_buffered_paos();
+    void finish_phase(int phase);
+    void finalize();
+    uint32_t num_finalize_workers() const {
+        return ntables_;
+    }
+    bool can_stream_finalize() const {
+        return true;
+    }
+    bool get_paos(PartialAgg** buf, uint64_t& num_read, uint64_t max);
+    void release_pao(PartialAgg* p);
+    bool release_results();
+  private:
+    static void *worker(void *arg);
+    // appends the PAOs of one table to results_
+    void finalize_table(uint32_t tableid);
+    void submit_array(uint32_t tableid, PAOArray* buf);
+
+  private:
+    const uint32_t kInsertAtOnce;
+
+    uint32_t ntables_;
+    fixed_key_table<K>** tables_;
+
+    // buffer pool
+    PAOArray** buffered_paos_;
+    numa_bufferpool* bufpool_;
+
+    // pooled threads for insertion into the tables (see mthread_create_aux)
+    int* tid_;
+    std::vector<mpsc_queue<PAOArray*>*> queues_;
+
+    // next slot to read out of each table in get_paos()
+    uint64_t* ind_;
+};
+
+template <typename K>
+map_fixed_manager<K>::map_fixed_manager() :
+        kInsertAtOnce(10000),
+        ntables_(0),
+        tables_(NULL),
+        buffered_paos_(NULL),
+        bufpool_(NULL),
+        tid_(NULL),
+        ind_(NULL) {
+}
+
+template <typename K>
+map_fixed_manager<K>::~map_fixed_manager() {
+    // clean up buffers
+    delete[] buffered_paos_;
+    delete bufpool_;
+
+    // clean up tables
+    for (uint32_t j = 0; j < ntables_; ++j) {
+        delete tables_[j];
+        delete queues_[j];
+    }
+    delete[] tables_;
+    delete[] tid_;
+    delete[] ind_;
+}
+
+template <typename K>
+void map_fixed_manager<K>::init(Operations* ops, uint32_t ncore,
+        uint32_t ntables) {
+    ops_ = ops;
+    ncore_ = ncore;
+    ntables_ = ntables;
+    assert(ops_->paoSize() && ops_->arenaAllocatable() &&
+            ops_->keySize() == sizeof(K) &&
+            "fixed-key backends need fixed-size PAOs and keys");
+
+    tables_ = new fixed_key_table<K>*[ntables_];
+    const topology& topo = topology::get();
+    for (uint32_t j = 0; j < ntables_; ++j) {
+        // on the node of the table's aggregator
+        numa_preferred on(topo.home_node(j, ntables_));
+        tables_[j] = new fixed_key_table<K>(ops_);
+
+        // a queue never holds more than the whole buffer pool; every map
+        // worker is a producer
+        queues_.push_back(new mpsc_queue<PAOArray*>(ncore_ * ntables_ * 3,
+                ncore_));
+    }
+
+    // create a pool of buffers
+    bufpool_ = new numa_bufferpool(ops_, kInsertAtOnce, ncore_ * 3, ntables_,
+            ncore_);
+    buffered_paos_ = new PAOArray*[ncore_ * ntables_];
+    for (uint32_t j = 0; j < ncore_ * ntables_; ++j)
+        buffered_paos_[j] = bufpool_->get_buffer(j % ntables_, j / ntables_);
+
+    // set up workers for insertion into the tables, placed by the
+    // topology policy
+    tid_ = new int[ntables_];
+    for (uint32_t j = 0; j < ntables_; ++j) {
+        args_struct* a = new args_struct(2);
+        a->argv[0] = (void*)this;
+        a->argv[1] = (void*)((intptr_t)j);
+        cpu_set_t cset;
+        topo.aggregator_cpus(j, ntables_, ncore_, &cset);
+        tid_[j] = mthread_create_aux(worker, a, &cset);
+    }
+
+    // results mutex
+    pthread_mutex_init(&results_mutex_, NULL);
+
+    ind_ = new uint64_t[ntables_];
+    for (uint32_t i = 0; i < ntables_; ++i)
+        ind_[i] = 0;
+}
+
+template <typename K>
+void map_fixed_manager<K>::submit_array(uint32_t tableid, PAOArray* buf) {
+    queues_[tableid]->push(buf);
+}
+
+template <typename K>
+bool map_fixed_manager<K>::emit(void *k, void *v, size_t keylen, unsigned hash,
+        bool view) {
+    assert(keylen == sizeof(K));
+    uint32_t tableid = hash % ntables_;
+    PAOArray** slots = core_slots(buffered_paos_, ntables_);
+    PAOArray* buf = slots[tableid];
+    uint32_t ind = buf->index();
+    set_key(buf->list()[ind], k, keylen, view);
+    ops()->setValue(buf->list()[ind], v);
+    buf->hashes()[ind] = hash;
+    buf->set_index(ind + 1);
+
+    if (buf->index() == kInsertAtOnce) {
+        submit_array(tableid, buf);
+        // get new buffer from pool
+        slots[tableid] = bufpool_->get_buffer(tableid,
+                threadinfo::current()->cur_core_);
+    }
+    return true;
+}
+
+template <typename K>
+void map_fixed_manager<K>::flush_buffered_paos() {
+    uint32_t coreid = threadinfo::current()->cur_core_;
+    for (uint32_t tableid = 0; tableid < ntables_; ++tableid) {
+        uint32_t bufid = coreid * ntables_ + tableid;
+        submit_array(tableid, buffered_paos_[bufid]);
+        queues_[tableid]->producer_done();
+    }
+}
+
+template <typename K>
+void map_fixed_manager<K>::finish_phase(int phase) {
+    switch (phase) {
+        case MAP: {
+            for (uint32_t j = 0; j < ntables_; ++j)
+                mthread_join_aux(tid_[j]);
+            bufpool_->print_stats(stderr);
+            uint64_t nkeys = 0, bytes = 0;
+            for (uint32_t j = 0; j < ntables_; ++j) {
+                nkeys += tables_[j]->size();
+                bytes += tables_[j]->memory();
+            }
+            fprintf(stderr, "Fixed-key tables: %lu keys, %lu KB\n", nkeys,
+                    bytes >> 10);
+            break;
+        }
+        case FINALIZE:
+            break;
+        default:
+            assert(0);
+    }
+}
+
+template <typename K>
+void* map_fixed_manager<K>::worker(void *x) {
+    args_struct* a = (args_struct*)x;
+    map_fixed_manager* m = (map_fixed_manager*)(a->argv[0]);
+    uint32_t tableid = (intptr_t)(a->argv[1]);
+    delete a;
+    mpsc_queue<PAOArray*>* q = m->queues_[tableid];
+    fixed_key_table<K>* t = m->tables_[tableid];
+    const Operations* ops = m->ops();
+
+    PAOArray* buf;
+    // returns false once every map worker has flushed its last buffer
+    while (q->pop(buf)) {
+        PartialAgg** arr = buf->list();
+        uint32_t ind = buf->index();
+        for (uint32_t i = 0; i < ind; ++i) {
+            K key = key_traits<K>::load(ops->getKey(arr[i]));
+            bool found;
+            PartialAgg* p = t->find_or_insert(key, found);
+            if (found) {
+                ops->merge(p, arr[i]);
+                continue;
+            }
+            ops->setKeyView(p, (const char*)&key, sizeof(key));
+            ops->setValue(p, ops->getValue(arr[i]));
+        }
+
+        // return buffer to pool
+        m->bufpool_->return_buffer(tableid, buf);
+    }
+    if (m->stream_finalize_)
+        m->finalize_table(tableid);
+    return 0;
+}
+
+template <typename K>
+void map_fixed_manager<K>::finalize() {
+    uint32_t coreid = threadinfo::current()->cur_core_;
+    if (coreid >= ntables_)
+        return;
+    finalize_table(coreid);
+}
+
+template <typename K>
+void map_fixed_manager<K>::finalize_table(uint32_t tableid) {
+    fixed_key_table<K>* t = tables_[tableid];
+
+    std::vector<PartialAgg*> temp;
+    temp.reserve(t->size());
+    for (uint64_t i = 0; i < t->capacity(); ++i)
+        if (t->used(i))
+            temp.push_back(t->at(i));
+
+    pthread_mutex_lock(&results_mutex_);
+    results_.insert(results_.end(), temp.begin(), temp.end());
+    pthread_mutex_unlock(&results_mutex_);
+}
+
+template <typename K>
+bool map_fixed_manager<K>::get_paos(PartialAgg** buf, uint64_t& num_read,
+        uint64_t max) {
+    uint32_t coreid = threadinfo::current()->cur_core_;
+    num_read = 0;
+    if (coreid >= ntables_)
+        return false;
+    fixed_key_table<K>* t = tables_[coreid];
+    uint64_t& i = ind_[coreid];
+    for (; i < t->capacity() && num_read < max; ++i)
+        if (t->used(i))
+            buf[num_read++] = t->at(i);
+    return i < t->capacity();
+}
+
+template <typename K>
+void map_fixed_manager<K>::release_pao(PartialAgg* p) {
+    // the PAOs live in the tables
+}
+
+template <typename K>
+bool map_fixed_manager<K>::release_results() {
+    for (uint32_t j = 0; j < ntables_; ++j)
+        tables_[j]->clear();
+    return true;
+}
+
+/* @brief: a map_manager_factory for map_fixed_manager<K> */
+template <typename K>
+map_manager* create_fixed_manager(Operations* ops, uint32_t ncore,
+        uint32_t npart) {
+    map_fixed_manager<K>* m = new map_fixed_manager<K>();
+    m->init(ops, ncore, npart);
+    return m;
+}
+
+#endif  // MAP_FIXED_MANAGER_HH_
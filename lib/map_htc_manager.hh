@@ -2,66 +2,86 @@
 #define MAP_HTC_MANAGER_HH_ 1
 
 #include <inttypes.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <vector>
-#include <deque>
 
 #include "array.hh"
 #include "test_util.hh"
 #include "appbase.hh"
 #include "bufferpool.hh"
+#include "thread.hh"
 #include "threadinfo.hh"
+#include "topology.hh"
 #include "CompressTree.h"
-#include "HashUtil.h"
+#include "hashed_key.hh"
+#include "mpsc_queue.hh"
+#include "pao_arena.hh"
 #include "PartialAgg.h"
 
 struct args_struct;
 
+// keys carry their emit-time hash, so the table never rehashes them
 struct HashCompare {
-    static size_t hash(const char* key)
-    {
-        size_t a = HashUtil::BobHash(key, strlen(key), 42);
-        return a;
+    static size_t hash(const hashed_key& k) {
+        return k.mixed_hash();
     }
-    //! True if strings are equal
-    static bool equal(const char* s1, const char* s2) {
-        return (s1 && s2 && strcmp(s1, s2) == 0);
+    static bool equal(const hashed_key& k1, const hashed_key& k2) {
+        return k1 == k2;
     }
 };
 
-typedef tbb::concurrent_hash_map<const char*, PartialAgg*,
+typedef tbb::concurrent_hash_map<hashed_key, PartialAgg*,
         HashCompare> Hashtable;
 
+// per TBB thread arena for the aggregated PAOs; created on first use
+typedef tbb::enumerable_thread_specific<pao_arena*> ArenaSet;
+
 struct Aggregate {
     Hashtable* ht;
     bool destroyMerged_;
     const Operations* const ops;
+    ArenaSet* arenas;
+    PAOArray* buf;
 
     Aggregate(Hashtable* ht_, bool destroy,
-            const Operations* const ops) :
+            const Operations* const ops, ArenaSet* arenas_, PAOArray* b) :
         ht(ht_),
         destroyMerged_(destroy),
-        ops(ops) {}
+        ops(ops),
+        arenas(arenas_),
+        buf(b) {}
     void operator()(const tbb::blocked_range<PartialAgg**> r) const
     {
-        PartialAgg* new_pao = NULL;
+        pao_arena* arena = NULL;
+        if (arenas) {
+            pao_arena*& local = arenas->local();
+            if (!local)
+                local = new pao_arena(ops);
+            arena = local;
+        }
         for (PartialAgg** it=r.begin(); it != r.end(); ++it) {
             Hashtable::accessor a;
-            if (!new_pao)
-                ops->createPAO(NULL, &new_pao);
-            ops->setKey(new_pao, (char*)ops->getKey(*it));
-            char* k = (char*)(ops->getKey(new_pao));
-            if (ht->insert(a, k)) { // wasn't present
-                void* v = ops->getValue(*it);
-                ops->setValue(new_pao, v);
-                a->second = new_pao;
-                new_pao = NULL;
-            } else { // already present
+            // probe with the key in the buffer
+            uint32_t i = it - buf->list();
+            hashed_key k(ops->getKey(*it), buf->hashes()[i],
+                    buf->keylens()[i]);
+            if (!ht->insert(a, k)) { // already present
                 ops->merge(a->second, *it);
+                continue;
             }
-        }
-        if (new_pao) {
-            ops->destroyPAO(new_pao);
-            new_pao = NULL;
+            // new key: copy it out of the buffer, which will be reused,
+            // and point the entry at the copy. Threads comparing against
+            // the entry meanwhile read either copy; the buffer is only
+            // returned once all of it is aggregated.
+            PartialAgg* new_pao;
+            if (arena)
+                new_pao = arena->create();
+            else
+                ops->createPAO(NULL, &new_pao);
+            ops->setKey(new_pao, (char*)k.key);
+            ops->setValue(new_pao, ops->getValue(*it));
+            a->first.key = ops->getKey(new_pao);
+            a->second = new_pao;
         }
     }
 };
@@ -71,29 +91,33 @@ struct map_htc_manager : public map_manager {
     map_htc_manager();
     ~map_htc_manager();
     void init(Operations* ops, uint32_t ncore);
-    bool emit(void *key, void *val, size_t keylen, unsigned hash);
+    bool emit(void *key, void *val, size_t keylen, unsigned hash,
+            bool view);
     void flush_buffered_paos();
     void finish_phase(int phase);
     void finalize();
+    void release_pao(PartialAgg* p);
+    bool release_results();
   private:
     static void *worker(void *arg);
+    void release_arenas();
     static void *random_input_worker(void *arg);
     void submit_array(PAOArray* buf);
   private:
     const uint32_t kInsertAtOnce;
-    typedef tbb::concurrent_hash_map<const char*, PartialAgg*,
-            HashCompare> Hashtable;
     Hashtable* htc_;
 
     // buffer pool
     PAOArray** buffered_paos_;
     bufferpool* bufpool_;
 
-    // thread for insertion into HTC
-    pthread_t tid_;
-    pthread_mutex_t htc_queue_mutex_;
-    pthread_cond_t htc_queue_empty_;
-    std::deque<PAOArray*> htc_queue_;    
+    // arenas for the aggregated PAOs, NULL if the PAOs cannot be
+    // arena-allocated
+    ArenaSet* arenas_;
+
+    // pooled thread for insertion (see mthread_create_aux)
+    int tid_;
+    mpsc_queue<PAOArray*>* htc_queue_;
 
     // random input generation
     uint32_t num_unique_keys_;
@@ -106,7 +130,8 @@ struct map_htc_manager : public map_manager {
 
 map_htc_manager::map_htc_manager() :
         kInsertAtOnce(100000),
-        buffered_paos_(NULL) {
+        buffered_paos_(NULL),
+        arenas_(NULL) {
 } 
 
 map_htc_manager::~map_htc_manager() {
@@ -116,8 +141,12 @@ map_htc_manager::~map_htc_manager() {
 
     // clean up CBTs
     delete htc_;
-    pthread_mutex_destroy(&htc_queue_mutex_);
-    pthread_cond_destroy(&htc_queue_empty_);
+    delete htc_queue_;
+
+    if (arenas_) {
+        release_arenas();
+        delete arenas_;
+    }
 }
 
 void map_htc_manager::init(Operations* ops, uint32_t ncore) {
@@ -126,56 +155,51 @@ void map_htc_manager::init(Operations* ops, uint32_t ncore) {
 
     // create CBTs
     htc_ = new Hashtable();
+    if (ops_->paoSize() && ops_->arenaAllocatable())
+        arenas_ = new ArenaSet((pao_arena*)NULL);
 
-    pthread_mutex_init(&htc_queue_mutex_, NULL);
-    pthread_cond_init(&htc_queue_empty_, NULL);
-
-    // sending two arguments to workers
-    std::vector<args_struct*> args;
+    // the queue never holds more than the whole buffer pool; every map
+    // worker is a producer
+    htc_queue_ = new mpsc_queue<PAOArray*>(ncore_ * 3, ncore_);
 
     // create a pool of buffers
-    bufpool_ = new bufferpool(ops_, kInsertAtOnce, ncore_ * 3);
+    bufpool_ = new bufferpool(ops_, kInsertAtOnce, ncore_ * 3, ncore_);
     buffered_paos_ = new PAOArray*[ncore_];
     for (uint32_t j = 0; j < ncore_ ; ++j) {
-        buffered_paos_[j] = bufpool_->get_buffer();
+        buffered_paos_[j] = bufpool_->get_buffer(j);
     }
 
     // set all cpus in cpu mask
     cpu_set_t cset;
-    CPU_ZERO(&cset);
-    for (uint32_t i = 0; i < JOS_NCPU; ++i)
-        CPU_SET(i, &cset);
+    topology::get().all_cpus(&cset);
 
     args_struct* a = new args_struct(2);
     a->argv[0] = (void*)this;
-    args.push_back(a);
-    pthread_create(&tid_, NULL, worker, a);
-    pthread_setaffinity_np(tid_, sizeof(cpu_set_t), &cset);
+    tid_ = mthread_create_aux(worker, a, &cset);
 
     // results mutex
     pthread_mutex_init(&results_mutex_, NULL);
 }
 
 void map_htc_manager::submit_array(PAOArray* buf) {
-    pthread_mutex_lock(&htc_queue_mutex_);
-    htc_queue_.push_back(buf);
-    pthread_cond_signal(&htc_queue_empty_);
-    pthread_mutex_unlock(&htc_queue_mutex_);
+    htc_queue_->push(buf);
 }
 
-bool map_htc_manager::emit(void *k, void *v, size_t keylen, unsigned hash) {
-    uint32_t coreid = threadinfo::current()->cur_core_;
-    uint32_t bufid = coreid;
-    PAOArray* buf = buffered_paos_[bufid];
+bool map_htc_manager::emit(void *k, void *v, size_t keylen, unsigned hash,
+        bool view) {
+    PAOArray** slots = core_slots(buffered_paos_, 1);
+    PAOArray* buf = *slots;
     uint32_t ind = buf->index();
-    ops()->setKey(buf->list()[ind], (char*)k);
+    set_key(buf->list()[ind], k, keylen, view);
     ops()->setValue(buf->list()[ind], v);
+    buf->hashes()[ind] = hash;
+    buf->keylens()[ind] = keylen;
     buf->set_index(ind + 1);
 
     if (buf->index() == kInsertAtOnce) {
         submit_array(buf);
         // get new buffer from pool
-        buffered_paos_[bufid] = bufpool_->get_buffer();
+        *slots = bufpool_->get_buffer(threadinfo::current()->cur_core_);
     }
 //    fprintf(stderr, "[%ld], inserted at %d\n", pthread_self(), ind);
     return true;
@@ -186,12 +210,14 @@ void map_htc_manager::flush_buffered_paos() {
     uint32_t bufid = coreid;
     PAOArray* buf = buffered_paos_[bufid];
     submit_array(buf);
+    htc_queue_->producer_done();
 }
 
 void map_htc_manager::finish_phase(int phase) {
     switch (phase) {
         case MAP:
-            pthread_join(tid_, NULL);
+            mthread_join_aux(tid_);
+            bufpool_->print_stats(stderr);
             break;
         case FINALIZE:
             break;
@@ -203,41 +229,25 @@ void map_htc_manager::finish_phase(int phase) {
 void* map_htc_manager::worker(void *x) {
     args_struct* a = (args_struct*)x;
     map_htc_manager* m = (map_htc_manager*)(a->argv[0]);
-    std::deque<PAOArray*>& q = m->htc_queue_;
+    delete a;
+    mpsc_queue<PAOArray*>* q = m->htc_queue_;
     cpu_set_t cset;
     pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
     tbb::task_scheduler_init init(tbb::task_scheduler_init::automatic);
 
-    while (true) {
-        pthread_mutex_lock(&m->htc_queue_mutex_);
-        while (q.empty())
-            pthread_cond_wait(&m->htc_queue_empty_,
-                    &m->htc_queue_mutex_);
-        pthread_mutex_unlock(&m->htc_queue_mutex_);
-
-        while (!q.empty()) {
-            // remove array from queue
-            pthread_mutex_lock(&m->htc_queue_mutex_);
-            PAOArray* buf = q.front();
-            q.pop_front();
-            pthread_mutex_unlock(&m->htc_queue_mutex_);
-
-            // perform insertion
-            uint32_t recv_length = buf->index();
+    PAOArray* buf;
+    // returns false once every map worker has flushed its last buffer
+    while (q->pop(buf)) {
+        // perform insertion
+        uint32_t recv_length = buf->index();
             
-            tbb::parallel_for(tbb::blocked_range<PartialAgg**>(buf->list(),
-                    buf->list() + recv_length, 100),
-                    Aggregate(m->htc_, /*destroy_pao = */false,
-                    m->ops()));
-
-            // return buffer to pool
-            m->bufpool_->return_buffer(buf);
-        }
+        tbb::parallel_for(tbb::blocked_range<PartialAgg**>(buf->list(),
+                buf->list() + recv_length, 100),
+                Aggregate(m->htc_, /*destroy_pao = */false,
+                m->ops(), m->arenas_, buf));
 
-        int ret;
-        sem_getvalue(&m->phase_semaphore_, &ret);
-        if (ret == (int)m->ncore_)
-            break;
+        // return buffer to pool
+        m->bufpool_->return_buffer(buf);
     }
     return 0;
 }
@@ -265,4 +275,27 @@ exit_loop:
     temp.clear();
 }
 
+void map_htc_manager::release_pao(PartialAgg* p) {
+    // arena PAOs go away with the arenas
+    if (!arenas_)
+        ops_->destroyPAO(p);
+}
+
+bool map_htc_manager::release_results() {
+    if (!arenas_)
+        return false;
+    // the table points into the arenas
+    htc_->clear();
+    release_arenas();
+    return true;
+}
+
+void map_htc_manager::release_arenas() {
+    for (ArenaSet::iterator it = arenas_->begin(); it != arenas_->end();
+            ++it) {
+        delete *it;
+        *it = NULL;
+    }
+}
+
 #endif
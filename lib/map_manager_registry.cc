@@ -0,0 +1,103 @@
+#include <assert.h>
+
+#include "map_manager_registry.hh"
+#include "map_cbt_manager.hh"
+#include "map_htc_manager.hh"
+#include "map_sh_manager.hh"
+#include "map_nsort_manager.hh"
+#include "map_oa_manager.hh"
+#include "map_fixed_manager.hh"
+
+namespace {
+map_manager* create_cbt(Operations* ops, uint32_t ncore, uint32_t npart) {
+    map_cbt_manager* m = new map_cbt_manager();
+    m->init(ops, ncore, npart);
+    return m;
+}
+
+map_manager* create_htc(Operations* ops, uint32_t ncore, uint32_t npart) {
+    map_htc_manager* m = new map_htc_manager();
+    m->init(ops, ncore);
+    return m;
+}
+
+map_manager* create_sh(Operations* ops, uint32_t ncore, uint32_t npart) {
+    map_sh_manager* m = new map_sh_manager();
+    m->init(ops, ncore, npart);
+    return m;
+}
+
+map_manager* create_oa(Operations* ops, uint32_t ncore, uint32_t npart) {
+    map_oa_manager* m = new map_oa_manager();
+    m->init(ops, ncore, npart);
+    return m;
+}
+
+map_manager* create_nsort(Operations* ops, uint32_t ncore, uint32_t npart) {
+    map_nsort_manager* m = new map_nsort_manager();
+    m->init(ops, ncore);
+    return m;
+}
+}
+
+map_manager_registry::table_t& map_manager_registry::backends() {
+    static table_t t;
+    if (t.empty()) {
+        t["cbt"] = make_entry(create_cbt, 0);
+        t["htc"] = make_entry(create_htc, 0);
+        t["sh"] = make_entry(create_sh, 0);
+        t["nsort"] = make_entry(create_nsort, 0);
+        t["oa"] = make_entry(create_oa, 0);
+        t[fixed_key_backend(sizeof(uint32_t))] = make_entry(
+                create_fixed_manager<uint32_t>, sizeof(uint32_t));
+        t[fixed_key_backend(sizeof(uint64_t))] = make_entry(
+                create_fixed_manager<uint64_t>, sizeof(uint64_t));
+    }
+    return t;
+}
+
+std::string map_manager_registry::fixed_key_backend(size_t width) {
+    char name[32];
+    if (width == sizeof(uint32_t) || width == sizeof(uint64_t))
+        snprintf(name, sizeof(name), "u%zu", width * 8);
+    else
+        snprintf(name, sizeof(name), "fixed%zu", width);
+    return name;
+}
+
+map_manager_registry::entry map_manager_registry::make_entry(
+        map_manager_factory f, size_t key_width) {
+    entry e;
+    e.f = f;
+    e.key_width = key_width;
+    return e;
+}
+
+void map_manager_registry::add(const std::string& name,
+        map_manager_factory f, size_t key_width) {
+    assert(f);
+    backends()[name] = make_entry(f, key_width);
+}
+
+bool map_manager_registry::has(const std::string& name) {
+    return backends().count(name) > 0;
+}
+
+size_t map_manager_registry::key_width(const std::string& name) {
+    table_t::iterator it = backends().find(name);
+    return it == backends().end() ? 0 : it->second.key_width;
+}
+
+map_manager* map_manager_registry::create(const std::string& name,
+        Operations* ops, uint32_t ncore, uint32_t npart) {
+    table_t::iterator it = backends().find(name);
+    if (it == backends().end())
+        return NULL;
+    return it->second.f(ops, ncore, npart);
+}
+
+void map_manager_registry::print_backends(FILE* f) {
+    table_t& t = backends();
+    for (table_t::iterator it = t.begin(); it != t.end(); ++it)
+        fprintf(f, "%s%s", it == t.begin()? "" : ", ", it->first.c_str());
+}
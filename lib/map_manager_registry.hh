@@ -0,0 +1,49 @@
+#ifndef MAP_MANAGER_REGISTRY_HH_
+#define MAP_MANAGER_REGISTRY_HH_ 1
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+
+#include "PartialAgg.h"
+
+struct map_manager;
+
+/* @brief: creates and initializes a map manager. @npart is the number of
+ * partitions (trees/tables) requested by the user; backends that use a
+ * single partition ignore it. */
+typedef map_manager* (*map_manager_factory)(Operations* ops, uint32_t ncore,
+        uint32_t npart);
+
+/* @brief: name -> factory table for the aggregation backends. The built-in
+ * backends (cbt, htc, sh, oa, nsort and, for fixed-width keys, u32 and u64)
+ * are always present; applications can add their own with add(). */
+struct map_manager_registry {
+    /* @brief: a non-zero @key_width marks a backend for fixed-width keys
+     * of that many bytes (see Operations::keySize()) */
+    static void add(const std::string& name, map_manager_factory f,
+            size_t key_width = 0);
+    static bool has(const std::string& name);
+    /* @brief: the key width @name was added with; 0 for string keys or an
+     * unknown name */
+    static size_t key_width(const std::string& name);
+    static map_manager* create(const std::string& name, Operations* ops,
+            uint32_t ncore, uint32_t npart);
+    static void print_backends(FILE* f);
+    /* @brief: the name of the default backend for fixed-width keys of
+     * @width bytes: "u32", "u64" or e.g. "fixed16" for binary_key<16>,
+     * which the application has to add() with create_fixed_manager(). */
+    static std::string fixed_key_backend(size_t width);
+
+  private:
+    struct entry {
+        map_manager_factory f;
+        size_t key_width;
+    };
+    typedef std::map<std::string, entry> table_t;
+    static entry make_entry(map_manager_factory f, size_t key_width);
+    static table_t& backends();
+};
+
+#endif  // MAP_MANAGER_REGISTRY_HH_
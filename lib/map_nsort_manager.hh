@@ -2,17 +2,20 @@
 #define MAP_NSORT_MANAGER_HH_ 1
 
 #include <inttypes.h>
+#include <semaphore.h>
 #include <vector>
-#include <deque>
 
 #include "array.hh"
 #include "test_util.hh"
 #include "appbase.hh"
 #include "bufferpool.hh"
 #include "nsort.h"
+#include "thread.hh"
 #include "threadinfo.hh"
+#include "topology.hh"
 #include "CompressTree.h"
 #include "HashUtil.h"
+#include "mpsc_queue.hh"
 #include "PartialAgg.h"
 
 struct args_struct;
@@ -41,7 +44,8 @@ struct map_nsort_manager : public map_manager {
     map_nsort_manager();
     ~map_nsort_manager();
     void init(Operations* ops, uint32_t ncore);
-    bool emit(void *key, void *val, size_t keylen, unsigned hash);
+    bool emit(void *key, void *val, size_t keylen, unsigned hash,
+            bool view);
     void flush_buffered_paos();
     void finish_phase(int phase);
     void finalize();
@@ -64,15 +68,14 @@ struct map_nsort_manager : public map_manager {
     PAOArray** buffered_paos_;
     bufferpool* bufpool_;
 
-    // thread for insertion into HTC
-    pthread_t tid_;
-    pthread_mutex_t nsort_queue_mutex_;
-    pthread_cond_t nsort_queue_empty_;
-    std::deque<nsort_buffer*> nsort_queue_;    
+    // pooled thread for insertion (see mthread_create_aux)
+    int tid_;
+    mpsc_queue<nsort_buffer*>* nsort_queue_;
 };
 
 map_nsort_manager::map_nsort_manager() :
-        kInsertAtOnce(100000), nsort_all_results_read_(false),
+        kInsertAtOnce(100000),
+        nsort_all_results_read_(false),
         buffered_paos_(NULL) {
 } 
 
@@ -83,8 +86,7 @@ map_nsort_manager::~map_nsort_manager() {
     sem_destroy(&nsort_buffer_semaphore_);
 
     pthread_mutex_destroy(&nsort_context_mutex_);
-    pthread_mutex_destroy(&nsort_queue_mutex_);
-    pthread_cond_destroy(&nsort_queue_empty_);
+    delete nsort_queue_;
 }
 
 void map_nsort_manager::init(Operations* ops, uint32_t ncore) {
@@ -93,32 +95,25 @@ void map_nsort_manager::init(Operations* ops, uint32_t ncore) {
 
     sem_init(&nsort_buffer_semaphore_, 0, ncore_ * 10);
 
-    pthread_mutex_init(&nsort_queue_mutex_, NULL);
-    pthread_cond_init(&nsort_queue_empty_, NULL);
-
-    // sending two arguments to workers
-    std::vector<args_struct*> args;
+    // bounded by nsort_buffer_semaphore_; every map worker is a producer
+    nsort_queue_ = new mpsc_queue<nsort_buffer*>(ncore_ * 10, ncore_);
 
     // create a pool of buffers
-    bufpool_ = new bufferpool(ops_, kInsertAtOnce, ncore_ * 3);
+    bufpool_ = new bufferpool(ops_, kInsertAtOnce, ncore_ * 3, ncore_);
     buffered_paos_ = new PAOArray*[ncore_];
     for (uint32_t j = 0; j < ncore_ ; ++j) {
-        buffered_paos_[j] = bufpool_->get_buffer();
+        buffered_paos_[j] = bufpool_->get_buffer(j);
     }
 
     pthread_mutex_init(&nsort_context_mutex_, NULL);
 
     // set all cpus in cpu mask
     cpu_set_t cset;
-    CPU_ZERO(&cset);
-    for (uint32_t i = 0; i < JOS_NCPU; ++i)
-        CPU_SET(i, &cset);
+    topology::get().all_cpus(&cset);
 
     args_struct* a = new args_struct(2);
     a->argv[0] = (void*)this;
-    args.push_back(a);
-    pthread_create(&tid_, NULL, worker, a);
-    pthread_setaffinity_np(tid_, sizeof(cpu_set_t), &cset);
+    tid_ = mthread_create_aux(worker, a, &cset);
 
     // results mutex
     pthread_mutex_init(&results_mutex_, NULL);
@@ -144,11 +139,7 @@ void map_nsort_manager::submit_array(PAOArray* buf) {
     nbuf->size_ = offset;
     num_inserted_ += buf->index();
 
-    pthread_mutex_lock(&nsort_queue_mutex_);
-    nsort_queue_.push_back(nbuf);
-    pthread_cond_signal(&nsort_queue_empty_);
-//    fprintf(stderr, "qs: %d\t", nsort_queue_.size());
-    pthread_mutex_unlock(&nsort_queue_mutex_);
+    nsort_queue_->push(nbuf);
 
     // return buffer to pool immediately
     bufpool_->return_buffer(buf);
@@ -163,19 +154,19 @@ void map_nsort_manager::error_exit(const char *func, int err,
     exit(1);
 }
 
-bool map_nsort_manager::emit(void *k, void *v, size_t keylen, unsigned hash) {
-    uint32_t coreid = threadinfo::current()->cur_core_;
-    uint32_t bufid = coreid;
-    PAOArray* buf = buffered_paos_[bufid];
+bool map_nsort_manager::emit(void *k, void *v, size_t keylen, unsigned hash,
+        bool view) {
+    PAOArray** slots = core_slots(buffered_paos_, 1);
+    PAOArray* buf = *slots;
     uint32_t ind = buf->index();
-    ops()->setKey(buf->list()[ind], (char*)k);
+    set_key(buf->list()[ind], k, keylen, view);
     ops()->setValue(buf->list()[ind], v);
     buf->set_index(ind + 1);
 
     if (buf->index() == kInsertAtOnce) {
         submit_array(buf);
         // get new buffer from pool
-        buffered_paos_[bufid] = bufpool_->get_buffer();
+        *slots = bufpool_->get_buffer(threadinfo::current()->cur_core_);
     }
 //    fprintf(stderr, "[%ld], inserted at %d\n", pthread_self(), ind);
     return true;
@@ -186,12 +177,14 @@ void map_nsort_manager::flush_buffered_paos() {
     uint32_t bufid = coreid;
     PAOArray* buf = buffered_paos_[bufid];
     submit_array(buf);
+    nsort_queue_->producer_done();
 }
 
 void map_nsort_manager::finish_phase(int phase) {
     switch (phase) {
         case MAP:
-            pthread_join(tid_, NULL);
+            mthread_join_aux(tid_);
+            bufpool_->print_stats(stderr);
             break;
         case FINALIZE:
             break;
@@ -203,7 +196,8 @@ void map_nsort_manager::finish_phase(int phase) {
 void* map_nsort_manager::worker(void *x) {
     args_struct* a = (args_struct*)x;
     map_nsort_manager* m = (map_nsort_manager*)(a->argv[0]);
-    std::deque<nsort_buffer*>& q = m->nsort_queue_;
+    delete a;
+    mpsc_queue<nsort_buffer*>* q = m->nsort_queue_;
     cpu_set_t cset;
     pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
 
@@ -218,35 +212,18 @@ void* map_nsort_manager::worker(void *x) {
     if (err < 0)
         m->error_exit("nsort_define()", err, m->nsort_context_);
 
-    while (true) {
-        pthread_mutex_lock(&m->nsort_queue_mutex_);
-        while (q.empty())
-            pthread_cond_wait(&m->nsort_queue_empty_,
-                    &m->nsort_queue_mutex_);
-        pthread_mutex_unlock(&m->nsort_queue_mutex_);
-
-        while (!q.empty()) {
-            // remove array from queue
-            pthread_mutex_lock(&m->nsort_queue_mutex_);
-            nsort_buffer* nbuf = q.front();
-            q.pop_front();
-            pthread_mutex_unlock(&m->nsort_queue_mutex_);
-
-            // release records to nsort
-            int err;
-            if ((err = nsort_release_recs(nbuf->buf_, nbuf->size_,
-                            &m->nsort_context_)) < 0)
-                m->error_exit("nsort_release_recs()", err, m->nsort_context_);
-
-            // deallocate
-            delete nbuf;
-            sem_post(&m->nsort_buffer_semaphore_);
-        }
-
-        int ret;
-        sem_getvalue(&m->phase_semaphore_, &ret);
-        if (ret == (int)m->ncore_)
-            break;
+    nsort_buffer* nbuf;
+    // returns false once every map worker has flushed its last buffer
+    while (q->pop(nbuf)) {
+        // release records to nsort
+        int err;
+        if ((err = nsort_release_recs(nbuf->buf_, nbuf->size_,
+                        &m->nsort_context_)) < 0)
+            m->error_exit("nsort_release_recs()", err, m->nsort_context_);
+
+        // deallocate
+        delete nbuf;
+        sem_post(&m->nsort_buffer_semaphore_);
     }
 
     // finish
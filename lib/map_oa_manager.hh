@@ -0,0 +1,290 @@
+#ifndef MAP_OA_MANAGER_HH_
+#define MAP_OA_MANAGER_HH_ 1
+
+#include <inttypes.h>
+#include <vector>
+
+#include "appbase.hh"
+#include "bufferpool.hh"
+#include "thread.hh"
+#include "threadinfo.hh"
+#include "topology.hh"
+#include "mpsc_queue.hh"
+#include "oa_table.hh"
+#include "pao_arena.hh"
+#include "PartialAgg.h"
+
+struct args_struct;
+
+/* @brief: A map manager using flat open-addressing tables (see oa_table).
+ * Keys are partitioned over the tables by their emit-time hash, and every
+ * table is filled by its own aggregator thread. The hash travels with the
+ * key in the PAOArray, so the aggregators never rehash keys. */
+struct map_oa_manager : public map_manager {
+    map_oa_manager();
+    ~map_oa_manager();
+    void init(Operations* ops, uint32_t ncore, uint32_t ntables);
+    bool emit(void *key, void *val, size_t keylen, unsigned hash,
+            bool view);
+    void flush_buffered_paos();
+    void finish_phase(int phase);
+    void finalize();
+    uint32_t num_finalize_workers() const {
+        return ntables_;
+    }
+    bool can_stream_finalize() const {
+        return true;
+    }
+    bool get_paos(PartialAgg** buf, uint64_t& num_read, uint64_t max);
+    void release_pao(PartialAgg* p);
+    bool release_results();
+  private:
+    static void *worker(void *arg);
+    // appends the PAOs of one table to results_
+    void finalize_table(uint32_t tableid);
+    void submit_array(uint32_t tableid, PAOArray* buf);
+
+  private:
+    const uint32_t kInsertAtOnce;
+
+    uint32_t ntables_;
+    oa_table** tables_;
+
+    // buffer pool
+    PAOArray** buffered_paos_;
+    numa_bufferpool* bufpool_;
+
+    // one arena per table for the aggregated PAOs, empty if the PAOs
+    // cannot be arena-allocated
+    std::vector<pao_arena*> arenas_;
+
+    // pooled threads for insertion into the tables (see mthread_create_aux)
+    int* tid_;
+    std::vector<mpsc_queue<PAOArray*>*> queues_;
+
+    // next slot to read out of each table in get_paos()
+    uint64_t* ind_;
+};
+
+map_oa_manager::map_oa_manager() :
+        kInsertAtOnce(10000),
+        ntables_(0),
+        tables_(NULL),
+        buffered_paos_(NULL),
+        bufpool_(NULL),
+        tid_(NULL),
+        ind_(NULL) {
+}
+
+map_oa_manager::~map_oa_manager() {
+    // clean up buffers
+    delete[] buffered_paos_;
+    delete bufpool_;
+
+    // clean up tables
+    for (uint32_t j = 0; j < ntables_; ++j) {
+        delete tables_[j];
+        delete queues_[j];
+    }
+    for (uint32_t j = 0; j < arenas_.size(); ++j)
+        delete arenas_[j];
+    delete[] tables_;
+    delete[] tid_;
+    delete[] ind_;
+}
+
+void map_oa_manager::init(Operations* ops, uint32_t ncore, uint32_t ntables) {
+    ops_ = ops;
+    ncore_ = ncore;
+    ntables_ = ntables;
+
+    tables_ = new oa_table*[ntables_];
+    bool use_arena = ops_->paoSize() && ops_->arenaAllocatable();
+    const topology& topo = topology::get();
+    for (uint32_t j = 0; j < ntables_; ++j) {
+        // on the node of the table's aggregator
+        numa_preferred on(topo.home_node(j, ntables_));
+        tables_[j] = new oa_table();
+        if (use_arena)
+            arenas_.push_back(new pao_arena(ops_));
+
+        // a queue never holds more than the whole buffer pool; every map
+        // worker is a producer
+        queues_.push_back(new mpsc_queue<PAOArray*>(ncore_ * ntables_ * 3,
+                ncore_));
+    }
+
+    // create a pool of buffers
+    bufpool_ = new numa_bufferpool(ops_, kInsertAtOnce, ncore_ * 3, ntables_,
+            ncore_);
+    buffered_paos_ = new PAOArray*[ncore_ * ntables_];
+    for (uint32_t j = 0; j < ncore_ * ntables_; ++j)
+        buffered_paos_[j] = bufpool_->get_buffer(j % ntables_, j / ntables_);
+
+    // set up workers for insertion into the tables, placed by the
+    // topology policy
+    tid_ = new int[ntables_];
+    for (uint32_t j = 0; j < ntables_; ++j) {
+        args_struct* a = new args_struct(2);
+        a->argv[0] = (void*)this;
+        a->argv[1] = (void*)((intptr_t)j);
+        cpu_set_t cset;
+        topo.aggregator_cpus(j, ntables_, ncore_, &cset);
+        tid_[j] = mthread_create_aux(worker, a, &cset);
+    }
+
+    // results mutex
+    pthread_mutex_init(&results_mutex_, NULL);
+
+    ind_ = new uint64_t[ntables_];
+    for (uint32_t i = 0; i < ntables_; ++i)
+        ind_[i] = 0;
+}
+
+void map_oa_manager::submit_array(uint32_t tableid, PAOArray* buf) {
+    queues_[tableid]->push(buf);
+}
+
+bool map_oa_manager::emit(void *k, void *v, size_t keylen, unsigned hash,
+        bool view) {
+    uint32_t tableid = hash % ntables_;
+    PAOArray** slots = core_slots(buffered_paos_, ntables_);
+    PAOArray* buf = slots[tableid];
+    uint32_t ind = buf->index();
+    set_key(buf->list()[ind], k, keylen, view);
+    ops()->setValue(buf->list()[ind], v);
+    buf->hashes()[ind] = hash;
+    buf->keylens()[ind] = keylen;
+    buf->set_index(ind + 1);
+
+    if (buf->index() == kInsertAtOnce) {
+        submit_array(tableid, buf);
+        // get new buffer from pool
+        slots[tableid] = bufpool_->get_buffer(tableid,
+                threadinfo::current()->cur_core_);
+    }
+    return true;
+}
+
+void map_oa_manager::flush_buffered_paos() {
+    uint32_t coreid = threadinfo::current()->cur_core_;
+    for (uint32_t tableid = 0; tableid < ntables_; ++tableid) {
+        uint32_t bufid = coreid * ntables_ + tableid;
+        submit_array(tableid, buffered_paos_[bufid]);
+        queues_[tableid]->producer_done();
+    }
+}
+
+void map_oa_manager::finish_phase(int phase) {
+    switch (phase) {
+        case MAP:
+            for (uint32_t j = 0; j < ntables_; ++j)
+                mthread_join_aux(tid_[j]);
+            bufpool_->print_stats(stderr);
+            break;
+        case FINALIZE:
+            break;
+        default:
+            assert(0);
+    }
+}
+
+void* map_oa_manager::worker(void *x) {
+    args_struct* a = (args_struct*)x;
+    map_oa_manager* m = (map_oa_manager*)(a->argv[0]);
+    uint32_t tableid = (intptr_t)(a->argv[1]);
+    delete a;
+    mpsc_queue<PAOArray*>* q = m->queues_[tableid];
+    oa_table* t = m->tables_[tableid];
+    pao_arena* arena = m->arenas_.empty()? NULL : m->arenas_[tableid];
+    const Operations* ops = m->ops();
+
+    PAOArray* buf;
+    // returns false once every map worker has flushed its last buffer
+    while (q->pop(buf)) {
+        PartialAgg** arr = buf->list();
+        uint32_t* hashes = buf->hashes();
+        uint32_t* keylens = buf->keylens();
+        uint32_t ind = buf->index();
+        for (uint32_t i = 0; i < ind; ++i) {
+            const char* key = ops->getKey(arr[i]);
+            bool found;
+            oa_table::slot* s = t->find_or_insert(key, hashes[i], keylens[i],
+                    found);
+            if (found) {
+                ops->merge(s->pao, arr[i]);
+                continue;
+            }
+            // new key: copy it out of the buffer, which will be reused
+            PartialAgg* p;
+            if (arena)
+                p = arena->create();
+            else
+                ops->createPAO(NULL, &p);
+            ops->setKey(p, (char*)key);
+            ops->setValue(p, ops->getValue(arr[i]));
+            s->key = ops->getKey(p);
+            s->pao = p;
+        }
+
+        // return buffer to pool
+        m->bufpool_->return_buffer(tableid, buf);
+    }
+    if (m->stream_finalize_)
+        m->finalize_table(tableid);
+    return 0;
+}
+
+void map_oa_manager::finalize() {
+    uint32_t coreid = threadinfo::current()->cur_core_;
+    if (coreid >= ntables_)
+        return;
+    finalize_table(coreid);
+}
+
+void map_oa_manager::finalize_table(uint32_t tableid) {
+    oa_table* t = tables_[tableid];
+
+    std::vector<PartialAgg*> temp;
+    temp.reserve(t->size());
+    for (uint64_t i = 0; i < t->capacity(); ++i)
+        if (t->used(i))
+            temp.push_back(t->at(i).pao);
+
+    pthread_mutex_lock(&results_mutex_);
+    results_.insert(results_.end(), temp.begin(), temp.end());
+    pthread_mutex_unlock(&results_mutex_);
+}
+
+bool map_oa_manager::get_paos(PartialAgg** buf, uint64_t& num_read,
+        uint64_t max) {
+    uint32_t coreid = threadinfo::current()->cur_core_;
+    num_read = 0;
+    if (coreid >= ntables_)
+        return false;
+    oa_table* t = tables_[coreid];
+    uint64_t& i = ind_[coreid];
+    for (; i < t->capacity() && num_read < max; ++i)
+        if (t->used(i))
+            buf[num_read++] = t->at(i).pao;
+    return i < t->capacity();
+}
+
+void map_oa_manager::release_pao(PartialAgg* p) {
+    // arena PAOs go away with the arena
+    if (arenas_.empty())
+        ops_->destroyPAO(p);
+}
+
+bool map_oa_manager::release_results() {
+    if (arenas_.empty())
+        return false;
+    for (uint32_t j = 0; j < ntables_; ++j) {
+        // the tables point into the arenas
+        tables_[j]->clear();
+        arenas_[j]->release();
+    }
+    return true;
+}
+
+#endif  // MAP_OA_MANAGER_HH_
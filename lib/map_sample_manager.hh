@@ -0,0 +1,36 @@
+#ifndef MAP_SAMPLE_MANAGER_HH_
+#define MAP_SAMPLE_MANAGER_HH_ 1
+
+#include <inttypes.h>
+#include <set>
+
+#include "appbase.hh"
+
+/* @brief: A map manager that only records the hashes of the keys it is
+ * handed. Used on a prefix of the input to estimate the key cardinality
+ * when the aggregation backend is chosen automatically. Single-threaded. */
+struct map_sample_manager : public map_manager {
+    explicit map_sample_manager(uint64_t max_emits) :
+            kMaxEmits(max_emits), nemits_(0) {
+    }
+    bool emit(void *key, void *val, size_t keylen, unsigned hash,
+            bool view) {
+        if (nemits_ == kMaxEmits)
+            return false;
+        ++nemits_;
+        hashes_.insert(hash);
+        return true;
+    }
+    uint64_t num_emits() const {
+        return nemits_;
+    }
+    uint64_t num_distinct() const {
+        return hashes_.size();
+    }
+  private:
+    const uint64_t kMaxEmits;
+    uint64_t nemits_;
+    std::set<unsigned> hashes_;
+};
+
+#endif  // MAP_SAMPLE_MANAGER_HH_
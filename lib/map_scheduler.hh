@@ -0,0 +1,139 @@
+#ifndef MAP_SCHEDULER_HH_
+#define MAP_SCHEDULER_HH_ 1
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "bench.hh"
+
+/* @brief: Hands out the map tasks of a phase. The tasks are dealt
+ * round-robin, in order, to one deque per worker. A worker takes tasks
+ * from the front of its own deque; once that is empty, it steals from the
+ * back of the others. The splitters issue large splits first, so owners
+ * start with large tasks while thieves pick up the small ones near the
+ * end. Also keeps per-worker busy and idle times to show the tail of the
+ * phase. */
+struct map_scheduler {
+    map_scheduler() : nworkers_(0), order_(NULL), deques_(NULL),
+            phase_start_(0) {
+    }
+    ~map_scheduler() {
+        delete[] order_;
+        delete_cline_array(deques_, nworkers_);
+    }
+
+    /* @brief: deal tasks 0 .. @ntasks - 1 to @nworkers workers */
+    void init(uint32_t ntasks, uint32_t nworkers) {
+        delete[] order_;
+        delete_cline_array(deques_, nworkers_);
+        nworkers_ = nworkers;
+        order_ = new uint32_t[ntasks + 1];
+        deques_ = new_cline_array<deque>(nworkers_);
+        uint32_t pos = 0;
+        for (uint32_t w = 0; w < nworkers_; ++w) {
+            uint32_t head = pos;
+            for (uint32_t t = w; t < ntasks; t += nworkers_)
+                order_[pos++] = t;
+            deques_[w].range = pack(head, pos);
+        }
+        phase_start_ = read_tsc();
+    }
+
+    /* @brief: get the next task for worker @w. Returns false once all
+     * tasks have been handed out. */
+    bool next(uint32_t w, uint32_t& task) {
+        deque& d = deques_[w];
+        uint64_t now = read_tsc();
+        if (d.task_start)
+            d.busy += now - d.task_start;
+        bool found = take_front(w, task);
+        for (uint32_t i = 1; !found && i < nworkers_; ++i)
+            if ((found = take_back((w + i) % nworkers_, task)))
+                ++d.nstolen;
+        if (!found) {
+            d.task_start = 0;
+            d.finish = read_tsc();
+            return false;
+        }
+        ++d.ntasks;
+        d.task_start = read_tsc();
+        return true;
+    }
+
+    void print_stats(FILE* f) const {
+        uint64_t end = 0, first = ~0ULL;
+        uint32_t ntasks = 0, nstolen = 0;
+        for (uint32_t w = 0; w < nworkers_; ++w) {
+            end = std::max(end, deques_[w].finish);
+            first = std::min(first, deques_[w].finish);
+            ntasks += deques_[w].ntasks;
+            nstolen += deques_[w].nstolen;
+        }
+        for (uint32_t w = 0; w < nworkers_; ++w) {
+            const deque& d = deques_[w];
+            fprintf(f, "Map worker %u: %u tasks (%u stolen), busy %lu ms, "
+                    "idle %lu ms\n", w, d.ntasks, d.nstolen,
+                    cycle_to_ms(d.busy),
+                    cycle_to_ms(end - phase_start_ - d.busy));
+        }
+        fprintf(f, "Map scheduler: %u tasks, %u stolen, tail %lu ms\n",
+                ntasks, nstolen, cycle_to_ms(end - first));
+    }
+
+  private:
+    // [head, tail) of a deque in order_, packed so that the owner and
+    // thieves can update it with one CAS
+    static uint64_t pack(uint32_t head, uint32_t tail) {
+        return ((uint64_t)head << 32) | tail;
+    }
+
+    bool take_front(uint32_t w, uint32_t& task) {
+        uint64_t* r = &deques_[w].range;
+        uint64_t old = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+        uint32_t head, tail;
+        do {
+            head = old >> 32;
+            tail = (uint32_t)old;
+            if (head >= tail)
+                return false;
+        } while (!__atomic_compare_exchange_n(r, &old, pack(head + 1, tail),
+                true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        task = order_[head];
+        return true;
+    }
+
+    bool take_back(uint32_t w, uint32_t& task) {
+        uint64_t* r = &deques_[w].range;
+        uint64_t old = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+        uint32_t head, tail;
+        do {
+            head = old >> 32;
+            tail = (uint32_t)old;
+            if (head >= tail)
+                return false;
+        } while (!__atomic_compare_exchange_n(r, &old, pack(head, tail - 1),
+                true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        task = order_[tail - 1];
+        return true;
+    }
+
+    struct __attribute__ ((aligned(JOS_CLINE))) deque {
+        deque() : range(0), ntasks(0), nstolen(0), busy(0), task_start(0),
+                finish(0) {}
+        uint64_t range;
+        // only updated by the owning worker
+        uint32_t ntasks;
+        uint32_t nstolen;
+        uint64_t busy;
+        uint64_t task_start;
+        uint64_t finish;
+    };
+
+    uint32_t nworkers_;
+    uint32_t* order_;
+    deque* deques_;
+    uint64_t phase_start_;
+};
+
+#endif  // MAP_SCHEDULER_HH_
@@ -3,48 +3,51 @@
 
 #include <google/sparse_hash_map>
 #include <inttypes.h>
+#include <functional>
 #include <vector>
-#include <deque>
 
 #include "array.hh"
 #include "test_util.hh"
 #include "appbase.hh"
 #include "bufferpool.hh"
+#include "thread.hh"
 #include "threadinfo.hh"
+#include "topology.hh"
 #include "CompressTree.h"
-#include "HashUtil.h"
+#include "hashed_key.hh"
+#include "mpsc_queue.hh"
+#include "pao_arena.hh"
 #include "PartialAgg.h"
 
 struct args_struct;
 
-struct Murmur {
-    uint32_t operator()(const char* key) const
-    {
-        return HashUtil::MurmurHash(key, strlen(key), 42);
-    }
-};
-struct eqstr {
-    bool operator()(const char* s1, const char* s2) const
-    {
-        return (s1 && s2 && strcmp(s1, s2) == 0);
-    }
-};
-
-typedef google::sparse_hash_map<const char*, PartialAgg*, Murmur, 
-        eqstr> Hash;
+// keys carry their emit-time hash, so the table never rehashes them
+typedef google::sparse_hash_map<hashed_key, PartialAgg*,
+        hashed_key_hasher, std::equal_to<hashed_key> > Hash;
 
 /* @brief: A map manager using the SH as the internal data structure */
 struct map_sh_manager : public map_manager {
     map_sh_manager();
     ~map_sh_manager();
     void init(Operations* ops, uint32_t ncore, uint32_t ntables);
-    bool emit(void *key, void *val, size_t keylen, unsigned hash);
+    bool emit(void *key, void *val, size_t keylen, unsigned hash,
+            bool view);
     void flush_buffered_paos();
     void finish_phase(int phase);
     void finalize();
+    uint32_t num_finalize_workers() const {
+        return ntables_;
+    }
+    bool can_stream_finalize() const {
+        return true;
+    }
     bool get_paos(PartialAgg** buf, uint64_t& num_read, uint64_t max);
+    void release_pao(PartialAgg* p);
+    bool release_results();
   private:
     static void *worker(void *arg);
+    // appends the PAOs of one table to results_
+    void finalize_table(uint32_t tableid);
     void submit_array(uint32_t treeid, PAOArray* buf);
 
   private:
@@ -56,13 +59,15 @@ struct map_sh_manager : public map_manager {
 
     // buffer pool
     PAOArray** buffered_paos_;
-    bufferpool* bufpool_;
+    numa_bufferpool* bufpool_;
+
+    // one arena per table for the aggregated PAOs, empty if the PAOs
+    // cannot be arena-allocated
+    std::vector<pao_arena*> arenas_;
 
-    // threads for insertion into SHs
-    pthread_t* tid_;
-    pthread_mutex_t* sh_queue_mutex_;
-    pthread_cond_t* sh_queue_empty_;
-    std::vector<std::deque<PAOArray*>*> sh_queue_;    
+    // pooled threads for insertion into SHs (see mthread_create_aux)
+    int* tid_;
+    std::vector<mpsc_queue<PAOArray*>*> sh_queue_;
 
     // tracking indices when reading out
     uint32_t* ind_;
@@ -74,7 +79,6 @@ map_sh_manager::map_sh_manager() :
 } 
 
 map_sh_manager::~map_sh_manager() {
-    sem_destroy(&phase_semaphore_);
     // clean up buffers
     delete[] buffered_paos_;
     delete bufpool_;
@@ -82,12 +86,11 @@ map_sh_manager::~map_sh_manager() {
     // clean up SHs
     for (uint32_t j = 0; j < ntables_; ++j) {
         delete sh_[j];
-        pthread_mutex_destroy(&sh_queue_mutex_[j]);
-        pthread_cond_destroy(&sh_queue_empty_[j]);
+        delete sh_queue_[j];
     }
+    for (uint32_t j = 0; j < arenas_.size(); ++j)
+        delete arenas_[j];
     delete[] sh_;
-    delete[] sh_queue_mutex_;
-    delete[] sh_queue_empty_;
 
     delete[] ind_;
 }
@@ -99,52 +102,40 @@ void map_sh_manager::init(Operations* ops, uint32_t ncore, uint32_t ntables) {
 
     // create SHs
     sh_ = new Hash*[ntables_];
-    sh_queue_mutex_ = new pthread_mutex_t[ntables_];
-    sh_queue_empty_ = new pthread_cond_t[ntables_];
 
+    bool use_arena = ops_->paoSize() && ops_->arenaAllocatable();
+    const topology& topo = topology::get();
     for (uint32_t j = 0; j < ntables_; ++j) {
+        // on the node of the table's aggregator
+        numa_preferred on(topo.home_node(j, ntables_));
         sh_[j] = new Hash();
-        pthread_mutex_init(&sh_queue_mutex_[j], NULL);
-        pthread_cond_init(&sh_queue_empty_[j], NULL);
+        if (use_arena)
+            arenas_.push_back(new pao_arena(ops_));
 
-        std::deque<PAOArray*>* d = new std::deque<PAOArray*>();
-        sh_queue_.push_back(d);
+        // a queue never holds more than the whole buffer pool; every map
+        // worker is a producer
+        sh_queue_.push_back(new mpsc_queue<PAOArray*>(ncore_ * ntables_ * 3,
+                ncore_));
     }
 
     // set up workers for insertion into SHs
-    tid_ = new pthread_t[ntables_];
-    // sending two arguments to workers
-    std::vector<args_struct*> args;
-
+    tid_ = new int[ntables_];
     // create a pool of buffers
-    bufpool_ = new bufferpool(ops_, kInsertAtOnce, ncore_ * ntables_ * 3);
+    bufpool_ = new numa_bufferpool(ops_, kInsertAtOnce, ncore_ * 3, ntables_,
+            ncore_);
     buffered_paos_ = new PAOArray*[ncore_ * ntables_];
     for (uint32_t j = 0; j < ncore_ * ntables_; ++j) {
-        buffered_paos_[j] = bufpool_->get_buffer();
+        buffered_paos_[j] = bufpool_->get_buffer(j % ntables_, j / ntables_);
     }
 
-    // set all cpus in cpu mask
-    cpu_set_t cset1, cset2;
-    CPU_ZERO(&cset1);
-    CPU_ZERO(&cset2);
-    for (uint32_t i = 4; i < 6; ++i)
-        CPU_SET(i, &cset1);
-    for (uint32_t i = 12; i < 18; ++i)
-        CPU_SET(i, &cset1);
-    for (uint32_t i = 6; i < 12; ++i)
-        CPU_SET(i, &cset2);
-    for (uint32_t i = 18; i < 24; ++i)
-        CPU_SET(i, &cset2);
+    // place the aggregators by the topology policy
     for (uint32_t j = 0; j < ntables_; ++j) {
+        cpu_set_t cset;
+        topo.aggregator_cpus(j, ntables_, ncore_, &cset);
         args_struct* a = new args_struct(2);
         a->argv[0] = (void*)this;
         a->argv[1] = (void*)((intptr_t)j);
-        args.push_back(a);
-        pthread_create(&tid_[j], NULL, worker, a);
-        if (j < ntables_ / 2)
-            pthread_setaffinity_np(tid_[j], sizeof(cpu_set_t), &cset1);
-        else
-            pthread_setaffinity_np(tid_[j], sizeof(cpu_set_t), &cset2);
+        tid_[j] = mthread_create_aux(worker, a, &cset);
     }
 
     // results mutex
@@ -156,26 +147,26 @@ void map_sh_manager::init(Operations* ops, uint32_t ncore, uint32_t ntables) {
 }
 
 void map_sh_manager::submit_array(uint32_t treeid, PAOArray* buf) {
-    pthread_mutex_lock(&sh_queue_mutex_[treeid]);
-    sh_queue_[treeid]->push_back(buf);
-    pthread_cond_signal(&sh_queue_empty_[treeid]);
-    pthread_mutex_unlock(&sh_queue_mutex_[treeid]);
+    sh_queue_[treeid]->push(buf);
 }
 
-bool map_sh_manager::emit(void *k, void *v, size_t keylen, unsigned hash) {
+bool map_sh_manager::emit(void *k, void *v, size_t keylen, unsigned hash,
+        bool view) {
     uint32_t treeid = hash % ntables_;
-    uint32_t coreid = threadinfo::current()->cur_core_;
-    uint32_t bufid = coreid * ntables_ + treeid;
-    PAOArray* buf = buffered_paos_[bufid];
+    PAOArray** slots = core_slots(buffered_paos_, ntables_);
+    PAOArray* buf = slots[treeid];
     uint32_t ind = buf->index();
-    ops()->setKey(buf->list()[ind], (char*)k);
+    set_key(buf->list()[ind], k, keylen, view);
     ops()->setValue(buf->list()[ind], v);
+    buf->hashes()[ind] = hash;
+    buf->keylens()[ind] = keylen;
     buf->set_index(ind + 1);
 
     if (buf->index() == kInsertAtOnce) {
         submit_array(treeid, buf);
         // get new buffer from pool
-        buffered_paos_[bufid] = bufpool_->get_buffer();
+        slots[treeid] = bufpool_->get_buffer(treeid,
+                threadinfo::current()->cur_core_);
     }
 //    fprintf(stderr, "[%ld], inserted at %d\n", pthread_self(), ind);
     return true;
@@ -187,6 +178,7 @@ void map_sh_manager::flush_buffered_paos() {
         uint32_t bufid = coreid * ntables_ + treeid;
         PAOArray* buf = buffered_paos_[bufid];
         submit_array(treeid, buf);
+        sh_queue_[treeid]->producer_done();
     }
 }
 
@@ -194,12 +186,9 @@ void map_sh_manager::finish_phase(int phase) {
     switch (phase) {
         case MAP:
             for (uint32_t treeid = 0; treeid < ntables_; ++treeid) {
-                pthread_mutex_lock(&sh_queue_mutex_[treeid]);
-                pthread_cond_signal(&sh_queue_empty_[treeid]);
-                pthread_mutex_unlock(&sh_queue_mutex_[treeid]);
-
-                pthread_join(tid_[treeid], NULL);
+                mthread_join_aux(tid_[treeid]);
             }
+            bufpool_->print_stats(stderr);
             break;
         case FINALIZE:
             break;
@@ -212,65 +201,52 @@ void* map_sh_manager::worker(void *x) {
     args_struct* a = (args_struct*)x;
     map_sh_manager* m = (map_sh_manager*)(a->argv[0]);
     uint32_t treeid = (intptr_t)(a->argv[1]);
-    std::deque<PAOArray*>* q = m->sh_queue_[treeid];
+    delete a;
+    mpsc_queue<PAOArray*>* q = m->sh_queue_[treeid];
     cpu_set_t cset;
     pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
 
-    while (true) {
-        pthread_mutex_lock(&m->sh_queue_mutex_[treeid]);
-        pthread_cond_wait(&m->sh_queue_empty_[treeid],
-                &m->sh_queue_mutex_[treeid]);
-        pthread_mutex_unlock(&m->sh_queue_mutex_[treeid]);
-
-        while (!q->empty()) {
-            // remove array from queue
-            pthread_mutex_lock(&m->sh_queue_mutex_[treeid]);
-            PAOArray* buf = q->front();
-            q->pop_front();
-            pthread_mutex_unlock(&m->sh_queue_mutex_[treeid]);
-
-            // perform insertion
-            PartialAgg** arr = buf->list();
-            uint32_t ind = buf->index();
-
-            PartialAgg* new_pao = NULL;
-            std::pair<Hash::iterator, bool> ret;
-            for (uint32_t i = 0; i < ind; ++i) {
-                if (!new_pao)
-                    m->ops()->createPAO(NULL, &new_pao);
-
-                // read the key from buffer and set the key in the new PAO.
-                // This involves a key copy because the PAO in the buffer will
-                // be reused
-                char* key_from_buf = (char*)(m->ops()->getKey(arr[i]));
-                m->ops()->setKey(new_pao, key_from_buf);
-
-                char* key_from_new_pao = (char*)(m->ops()->getKey(new_pao));
-                // try to insert the key value pair
-                ret = m->sh_[treeid]->insert(
-                        std::make_pair<char*, PartialAgg*>(
-                        key_from_new_pao, new_pao));
-                Hash::iterator ins_it = ret.first;
-                if (ret.second) { // insertion was successful
-                    // make a copy of the value as well
-                    void* v = m->ops()->getValue(arr[i]);
-                    m->ops()->setValue(new_pao, v);
-                    ins_it->second = new_pao;
-                    new_pao = NULL;
-                } else { // already present
-                    m->ops()->merge(ins_it->second, arr[i]);
-                }
+    pao_arena* arena = m->arenas_.empty()? NULL : m->arenas_[treeid];
+
+    PAOArray* buf;
+    // returns false once every map worker has flushed its last buffer
+    while (q->pop(buf)) {
+        // perform insertion
+        PartialAgg** arr = buf->list();
+        uint32_t* hashes = buf->hashes();
+        uint32_t* keylens = buf->keylens();
+        uint32_t ind = buf->index();
+
+        std::pair<Hash::iterator, bool> ret;
+        for (uint32_t i = 0; i < ind; ++i) {
+            // probe with the key in the buffer
+            char* key_from_buf = (char*)(m->ops()->getKey(arr[i]));
+            ret = m->sh_[treeid]->insert(std::make_pair(
+                    hashed_key(key_from_buf, hashes[i], keylens[i]),
+                    (PartialAgg*)NULL));
+            Hash::iterator ins_it = ret.first;
+            if (!ret.second) { // already present
+                m->ops()->merge(ins_it->second, arr[i]);
+                continue;
             }
-
-            // return buffer to pool
-            m->bufpool_->return_buffer(buf);
+            // new key: copy it out of the buffer, which will be reused,
+            // and point the entry at the copy
+            PartialAgg* new_pao;
+            if (arena)
+                new_pao = arena->create();
+            else
+                m->ops()->createPAO(NULL, &new_pao);
+            m->ops()->setKey(new_pao, key_from_buf);
+            m->ops()->setValue(new_pao, m->ops()->getValue(arr[i]));
+            ins_it->first.key = m->ops()->getKey(new_pao);
+            ins_it->second = new_pao;
         }
 
-        int ret;
-        sem_getvalue(&m->phase_semaphore_, &ret);
-        if (ret == (int)m->ncore_)
-            break;
+        // return buffer to pool
+        m->bufpool_->return_buffer(treeid, buf);
     }
+    if (m->stream_finalize_)
+        m->finalize_table(treeid);
     return 0;
 }
 
@@ -278,23 +254,20 @@ void map_sh_manager::finalize() {
     uint32_t coreid = threadinfo::current()->cur_core_;
     if (coreid >= ntables_)
         return;
-    uint32_t tableid = coreid;
+    finalize_table(coreid);
+}
 
-    PAOArray* buf = buffered_paos_[coreid];
+void map_sh_manager::finalize_table(uint32_t tableid) {
+    std::vector<PartialAgg*> temp;
+    temp.reserve(sh_[tableid]->size());
     Hash::iterator it;
-    PartialAgg** arr = buf->list();
-    uint32_t ind = 0;
-    for (it = sh_[tableid]->begin(); it != sh_[tableid]->end(); ++it) {
-        arr[ind++] = it->second;
-        if (ind > kInsertAtOnce) {
-            // copy results
-            pthread_mutex_lock(&results_mutex_);
-            results_.insert(results_.end(), &buf->list()[0],
-                    &buf->list()[ind - 1]);
-            pthread_mutex_unlock(&results_mutex_);
-            ind = 0;
-        }
-    }
+    for (it = sh_[tableid]->begin(); it != sh_[tableid]->end(); ++it)
+        temp.push_back(it->second);
+
+    // copy results
+    pthread_mutex_lock(&results_mutex_);
+    results_.insert(results_.end(), temp.begin(), temp.end());
+    pthread_mutex_unlock(&results_mutex_);
 }
 
 bool map_sh_manager::get_paos(PartialAgg** buf, uint64_t& num_read,
@@ -318,4 +291,21 @@ bool map_sh_manager::get_paos(PartialAgg** buf, uint64_t& num_read,
     return false;
 }
 
+void map_sh_manager::release_pao(PartialAgg* p) {
+    // arena PAOs go away with the arena
+    if (arenas_.empty())
+        ops_->destroyPAO(p);
+}
+
+bool map_sh_manager::release_results() {
+    if (arenas_.empty())
+        return false;
+    for (uint32_t j = 0; j < ntables_; ++j) {
+        // the tables point into the arenas
+        sh_[j]->clear();
+        arenas_[j]->release();
+    }
+    return true;
+}
+
 #endif
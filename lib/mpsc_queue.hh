@@ -0,0 +1,148 @@
+#ifndef MPSC_QUEUE_HH_
+#define MPSC_QUEUE_HH_ 1
+
+#include <assert.h>
+#include <inttypes.h>
+#include <sched.h>
+
+#include "bench.hh"
+#include "futex.hh"
+
+/* @brief: Bounded lock-free multi-producer/single-consumer ring used to hand
+ * buffers from the map threads to an aggregator thread. Producers claim a
+ * slot with a CAS on the tail; every slot carries a sequence number so the
+ * consumer can tell a published slot from one that is still being filled.
+ * The consumer only enters the kernel (futex) when the ring is empty.
+ *
+ * Each producer marks the end of its stream with producer_done(); once all
+ * of them have, pop() drains what is left and then returns false, so the
+ * consumer never has to guess whether more input is coming. */
+template <typename T>
+struct mpsc_queue {
+    mpsc_queue(uint32_t min_capacity, uint32_t nproducers) :
+            mask_(0), cells_(NULL), tail_(0), open_producers_(nproducers),
+            head_(0), sleeping_(0) {
+        uint32_t cap = 2;
+        while (cap < min_capacity)
+            cap <<= 1;
+        mask_ = cap - 1;
+        cells_ = new cell[cap];
+        for (uint32_t i = 0; i < cap; ++i)
+            cells_[i].seq = i;
+    }
+    ~mpsc_queue() {
+        delete[] cells_;
+    }
+
+    /* @brief: called by any number of producers. Spins if the ring is full,
+     * which can only happen if it was sized smaller than the number of
+     * buffers in flight. */
+    void push(const T& v) {
+        uint64_t pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+        cell* c;
+        while (true) {
+            c = &cells_[pos & mask_];
+            uint64_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+            int64_t diff = (int64_t)seq - (int64_t)pos;
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&tail_, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            } else if (diff < 0) {
+                // full
+                sched_yield();
+                pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+            } else {
+                pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+            }
+        }
+        c->val = v;
+        __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+
+        // pairs with the fence in wait(): either the consumer sees the
+        // slot we just published or we see that it is asleep
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        wake_consumer();
+    }
+
+    /* @brief: end-of-stream mark; each producer calls this exactly once
+     * after its last push() */
+    void producer_done() {
+        uint32_t left = __atomic_sub_fetch(&open_producers_, 1,
+                __ATOMIC_SEQ_CST);
+        assert(left != (uint32_t)-1);
+        if (left == 0)
+            wake_consumer();
+    }
+
+    /* @brief: consumer only. Blocks until an element is available; returns
+     * false once every producer is done and the ring has been drained. */
+    bool pop(T& v) {
+        while (true) {
+            if (try_pop(v))
+                return true;
+            if (closed())
+                // everything published before the last producer_done()
+                return try_pop(v);
+            wait();
+        }
+    }
+
+    /* @brief: consumer only. Returns false if nothing is published. */
+    bool try_pop(T& v) {
+        cell* c = &cells_[head_ & mask_];
+        uint64_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        if (seq != head_ + 1)
+            return false;
+        v = c->val;
+        __atomic_store_n(&c->seq, head_ + mask_ + 1, __ATOMIC_RELEASE);
+        ++head_;
+        return true;
+    }
+
+    /* @brief: consumer only */
+    bool empty() const {
+        const cell* c = &cells_[head_ & mask_];
+        return __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != head_ + 1;
+    }
+
+    bool closed() const {
+        return __atomic_load_n(&open_producers_, __ATOMIC_ACQUIRE) == 0;
+    }
+
+  private:
+    /* @brief: consumer only. Parks until a producer publishes something or
+     * the last producer is done. */
+    void wait() {
+        __atomic_store_n(&sleeping_, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (empty() && !closed())
+            futex_wait(&sleeping_, 1);
+        __atomic_store_n(&sleeping_, 0, __ATOMIC_RELAXED);
+    }
+
+    void wake_consumer() {
+        if (__atomic_load_n(&sleeping_, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&sleeping_, 0, __ATOMIC_RELAXED);
+            futex_wake(&sleeping_, 1);
+        }
+    }
+
+    struct cell {
+        uint64_t seq;
+        T val;
+    };
+
+    uint64_t mask_;
+    cell* cells_;
+    // producers and the consumer write to different lines
+    char pad0_[JOS_CLINE];
+    uint64_t tail_;
+    uint32_t open_producers_;
+    char pad1_[JOS_CLINE];
+    uint64_t head_;
+    int sleeping_;
+    char pad2_[JOS_CLINE];
+};
+
+#endif  // MPSC_QUEUE_HH_
@@ -1,16 +1,188 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "bench.hh"
+#include "futex.hh"
 #include "mr-types.hh"
 
 size_t split_t::kBufferSize = 67108864;
 
+namespace {
+// chunk buffers shared by all splits; only the splits being mapped hold
+// one (or two, with prefetching), besides the first chunks read ahead for
+// the next splits
+struct buffer_pool {
+    buffer_pool() : nout_(0), max_(0), nahead_(0), max_ahead_(0),
+            nallocated_(0) {
+        pthread_mutex_init(&mu_, NULL);
+        pthread_cond_init(&cond_, NULL);
+    }
+    ~buffer_pool() {
+        for (size_t i = 0; i < free_.size(); ++i)
+            free(free_[i]);
+    }
+    pthread_mutex_t mu_;
+    pthread_cond_t cond_;
+    std::vector<char*> free_;
+    size_t nout_;
+    // 0 means no cap
+    size_t max_;
+    // buffers holding chunks read ahead, and their share of max_
+    size_t nahead_;
+    size_t max_ahead_;
+    size_t nallocated_;
+};
+
+buffer_pool& pool() {
+    static buffer_pool p;
+    return p;
+}
+
+// a free buffer, or NULL if one has to be allocated. Requires the pool
+// lock; the caller has counted the buffer out.
+char* take_buffer(buffer_pool& p) {
+    char* b = NULL;
+    if (!p.free_.empty()) {
+        b = p.free_.back();
+        p.free_.pop_back();
+    } else {
+        ++p.nallocated_;
+    }
+    return b;
+}
+
+char* alloc_buffer() {
+    char* b;
+    int r = posix_memalign((void**)&b, split_t::kBufferAlign,
+            round_up(split_t::kBufferSize + split_t::kBufferSlack,
+                split_t::kBufferAlign));
+    assert(r == 0);
+    return b;
+}
+}
+
+void split_t::set_buffer_size(size_t n) {
+    assert(n && pool().nallocated_ == 0);
+    kBufferSize = n;
+}
+
+void split_t::set_max_buffers(size_t n, size_t nahead) {
+    buffer_pool& p = pool();
+    pthread_mutex_lock(&p.mu_);
+    p.max_ = n;
+    p.max_ahead_ = nahead;
+    pthread_cond_broadcast(&p.cond_);
+    pthread_mutex_unlock(&p.mu_);
+}
+
+char* split_t::get_buffer() {
+    buffer_pool& p = pool();
+    pthread_mutex_lock(&p.mu_);
+    while (p.max_ && p.nout_ >= p.max_)
+        pthread_cond_wait(&p.cond_, &p.mu_);
+    ++p.nout_;
+    char* b = take_buffer(p);
+    pthread_mutex_unlock(&p.mu_);
+    return b ? b : alloc_buffer();
+}
+
+char* split_t::get_ahead_buffer() {
+    buffer_pool& p = pool();
+    pthread_mutex_lock(&p.mu_);
+    if (p.nahead_ >= p.max_ahead_ || (p.max_ && p.nout_ >= p.max_)) {
+        pthread_mutex_unlock(&p.mu_);
+        return NULL;
+    }
+    ++p.nout_;
+    ++p.nahead_;
+    char* b = take_buffer(p);
+    pthread_mutex_unlock(&p.mu_);
+    return b ? b : alloc_buffer();
+}
+
+void split_t::claim_ahead_buffer() {
+    buffer_pool& p = pool();
+    pthread_mutex_lock(&p.mu_);
+    assert(p.nahead_);
+    --p.nahead_;
+    pthread_mutex_unlock(&p.mu_);
+}
+
+void split_t::put_buffer(char* b) {
+    buffer_pool& p = pool();
+    pthread_mutex_lock(&p.mu_);
+    --p.nout_;
+    p.free_.push_back(b);
+    pthread_cond_signal(&p.cond_);
+    pthread_mutex_unlock(&p.mu_);
+}
+
 split_t::split_t() : 
         data(NULL),
         split_start_offset(0), split_end_offset(0),
-        chunk_start_offset(0), chunk_end_offset(0) {
-    bzero(this, sizeof(split_t));
-    data = (char*)malloc(kBufferSize);
+        chunk_start_offset(0), chunk_end_offset(0), overlap_length(0),
+        input_length(0), from_file(false),
+        next(NULL), map_base_(NULL), map_length_(0) {
+}
+
+void split_t::release_chunk() {
+    if (map_base_)
+        unmap_chunk();
+    else if (data)
+        put_buffer(data);
+    data = NULL;
+    if (next && next->data) {
+        // the reader may still be filling the buffer
+        while (__atomic_load_n(&next->state, __ATOMIC_ACQUIRE) ==
+                chunk_prefetch::PENDING)
+            futex_wait(&next->state, chunk_prefetch::PENDING);
+        put_buffer(next->data);
+    }
+    delete next;
+    next = NULL;
+}
+
+void split_t::map_chunk(int fd, size_t off, size_t len) {
+    if (map_base_)
+        unmap_chunk();
+    else if (data)
+        put_buffer(data);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t delta = off % page;
+    size_t file_length = round_up(delta + len, page);
+    // reserve as much zeroed address space as a read buffer (and at least
+    // one byte more than the chunk), then map the file over the front of
+    // the reservation. Untouched zero pages cost no memory.
+    map_length_ = round_up(delta + std::max(len + 1, kBufferSize), page);
+    char* base = (char*)mmap(NULL, map_length_, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(base != MAP_FAILED);
+    if (len) {
+        void* m = mmap(base, file_length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, off - delta);
+        assert(m == base);
+        madvise(base, file_length, MADV_SEQUENTIAL);
+        madvise(base, file_length, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+        // best effort, most filesystems ignore it
+        madvise(base, file_length, MADV_HUGEPAGE);
+#endif
+    }
+    map_base_ = base;
+    data = base + delta;
+    // the rest of the last page holds whatever follows the chunk in the
+    // file; clear it like a fresh read buffer
+    memset(data + len, 0, file_length - delta - len);
 }
 
-split_t::~split_t() {
-    if (data)
-        free(data);
+void split_t::unmap_chunk() {
+    if (!map_base_)
+        return;
+    munmap(map_base_, map_length_);
+    map_base_ = NULL;
+    map_length_ = 0;
+    data = NULL;
 }
@@ -22,15 +22,87 @@
 #include <string.h>
 #include "array.hh"
 
+/* @brief: the next chunk of a split, loaded in the background by a
+ * chunk_reader while the current one is processed */
+struct chunk_prefetch {
+    enum state_t {
+        IDLE,
+        PENDING,
+        READY,
+    };
+    chunk_prefetch() :
+            data(NULL), offset(0), length(0), done(0), state(IDLE) {}
+    char* data;
+    size_t offset;
+    size_t length;
+    // bytes read so far
+    size_t done;
+    int state;
+};
+
+/* @brief: A map task. The file splitters only fill in the offsets; the
+ * chunks are loaded into data on demand by get_split_chunk(), using buffers
+ * from a pool shared by all splits. No destructor: xarray moves and drops
+ * splits without running one, so release_chunk() frees what a split holds
+ * once it is exhausted. */
 struct split_t {
     split_t();
-    ~split_t();
     static size_t kBufferSize;
+    // NULL until the first chunk is loaded
     char* data;
     size_t split_start_offset;
     size_t split_end_offset;
     size_t chunk_start_offset;
     size_t chunk_end_offset;
+    // bytes at the end of the split that only serve to complete the
+    // records it owns; the next split starts where they start
+    size_t overlap_length;
+    // length of the whole input, or 0 if unknown; a tokenizer may move
+    // split_end_offset up to it to finish a record the split owns
+    size_t input_length;
+    // true if the chunks are loaded from the input file
+    bool from_file;
+
+    /* @brief: set the chunk size. Must be called before any buffer is
+     * handed out. */
+    static void set_buffer_size(size_t n);
+    /* @brief: cap the number of chunk buffers handed out at once at @n,
+     * of which up to @nahead may hold chunks read ahead for splits that
+     * have not started yet */
+    static void set_max_buffers(size_t n, size_t nahead = 0);
+    /* @brief: take a chunk buffer from the pool, waiting while the cap is
+     * reached. Buffers hold kBufferSize bytes plus kBufferSlack for
+     * terminating NULs and partial O_DIRECT blocks, and are aligned to
+     * kBufferAlign. */
+    static char* get_buffer();
+    static void put_buffer(char* b);
+    /* @brief: take a buffer for a chunk read ahead, or NULL if the share
+     * set aside for them is in use. Once its split starts, the buffer
+     * counts as an ordinary one after claim_ahead_buffer(). */
+    static char* get_ahead_buffer();
+    static void claim_ahead_buffer();
+    enum { kBufferAlign = 4096 };
+    enum { kBufferSlack = 2 * kBufferAlign + 1 };
+
+    /* @brief: give the chunk buffers (or the mapping) and next back once
+     * the split is exhausted */
+    void release_chunk();
+
+    /* @brief: point data at a private, writable mapping of @len bytes of
+     * @fd starting at @off, followed by NUL bytes. Tokenizers may modify
+     * the chunk; the changes are neither visible to other splits nor
+     * written back. Replaces the read buffer or any previous mapping. */
+    void map_chunk(int fd, size_t off, size_t len);
+    /* @brief: drop the current mapping, if any */
+    void unmap_chunk();
+
+    // set up by the chunk_reader when it first prefetches for us
+    chunk_prefetch* next;
+
+  private:
+    // non-NULL if data points into a mapping
+    char* map_base_;
+    size_t map_length_;
 };
 
 enum task_type_t {
@@ -41,4 +113,16 @@ enum task_type_t {
 /* suggested number of map tasks per core. */
 enum { def_nsplits_per_core = 16 };
 
+/* @brief: length of the next split under guided self-scheduling: a share
+ * of the @remaining input that shrinks as the input is consumed, but at
+ * least @min_length. Large splits come first and small ones last, which
+ * keeps the end of the map phase balanced. */
+inline size_t guided_split_length(size_t remaining, size_t min_length,
+        int ncores) {
+    size_t length = remaining / (2 * ncores);
+    if (length < min_length)
+        length = min_length;
+    return length < remaining ? length : remaining;
+}
+
 #endif
@@ -0,0 +1,179 @@
+#ifndef OA_TABLE_HH_
+#define OA_TABLE_HH_ 1
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bench.hh"
+#include "PartialAgg.h"
+
+/* @brief: Flat open-addressing table from string keys to PAOs, laid out like
+ * a Swiss table: slots come in groups of 16 with one control byte each. A
+ * control byte is either kEmpty or 7 bits of the key's hash, so a probe
+ * compares a whole group against the hash with one SSE2 compare and only
+ * looks at the slots whose bits match. Each slot keeps the full hash that
+ * was computed at emit time, which is also what the table grows by, so keys
+ * are never hashed again. There is no erase. Single writer. */
+struct oa_table {
+    struct slot {
+        const char* key;
+        PartialAgg* pao;
+        uint32_t hash;
+        uint32_t len;
+    };
+
+    explicit oa_table(uint32_t min_capacity = 1024) :
+            ctrl_(NULL), slots_(NULL), ngroups_(0), size_(0) {
+        uint32_t ngroups = 2;
+        while (ngroups * kGroupSize < min_capacity)
+            ngroups <<= 1;
+        alloc(ngroups);
+    }
+    ~oa_table() {
+        free(ctrl_);
+        free(slots_);
+    }
+
+    /* @brief: find the slot holding @key, whose emit-time hash and length
+     * are @hash and @len. If there is none, a slot is claimed for it and
+     * @found is false; the caller must then fill in key and pao, with key
+     * pointing at storage that lives as long as the table. */
+    slot* find_or_insert(const char* key, uint32_t hash, uint32_t len,
+            bool& found) {
+        slot* s = probe(key, hash, len, found);
+        if (found)
+            return s;
+        if (size_ >= max_load()) {
+            grow();
+            s = probe(key, hash, len, found);
+        }
+        ctrl_[s - slots_] = h2(hash);
+        s->hash = hash;
+        s->len = len;
+        ++size_;
+        return s;
+    }
+
+    /* @brief: drop all entries; the PAOs are not freed */
+    void clear() {
+        memset(ctrl_, kEmpty, capacity());
+        size_ = 0;
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+    uint64_t capacity() const {
+        return (uint64_t)ngroups_ * kGroupSize;
+    }
+    /* @brief: for iteration over slots [0, capacity()) */
+    bool used(uint64_t i) const {
+        return ctrl_[i] != kEmpty;
+    }
+    slot& at(uint64_t i) {
+        return slots_[i];
+    }
+
+  private:
+    static const uint32_t kGroupSize = 16;
+    static const int8_t kEmpty = -128;
+
+    static int8_t h2(uint32_t hash) {
+        return (int8_t)(hash >> 25);
+    }
+    // the partition already fixes the low bits of the hash, so spread all
+    // of them over the group index
+    uint32_t h1(uint32_t hash) const {
+        return (hash * 0x9e3779b9u) >> (32 - log_ngroups_);
+    }
+    uint64_t max_load() const {
+        return capacity() / 8 * 7;
+    }
+
+    /* @brief: bitmask of the slots in group @g whose control byte is @c */
+    uint32_t match(uint32_t g, int8_t c) const {
+        const int8_t* ctrl = ctrl_ + g * kGroupSize;
+#ifdef __SSE2__
+        __m128i grp = _mm_load_si128((const __m128i*)ctrl);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(grp, _mm_set1_epi8(c)));
+#else
+        uint32_t m = 0;
+        for (uint32_t i = 0; i < kGroupSize; ++i)
+            if (ctrl[i] == c)
+                m |= 1u << i;
+        return m;
+#endif
+    }
+
+    /* @brief: returns the slot holding @key, or the first empty slot on
+     * its probe sequence. Quadratic probing over groups visits every group
+     * because ngroups_ is a power of two. */
+    slot* probe(const char* key, uint32_t hash, uint32_t len, bool& found) {
+        const int8_t tag = h2(hash);
+        uint32_t mask = ngroups_ - 1;
+        uint32_t g = h1(hash) & mask;
+        for (uint32_t step = 1; ; ++step) {
+            for (uint32_t m = match(g, tag); m; m &= m - 1) {
+                slot* s = &slots_[g * kGroupSize + __builtin_ctz(m)];
+                if (s->hash == hash && s->len == len &&
+                        strcmp(s->key, key) == 0) {
+                    found = true;
+                    return s;
+                }
+            }
+            uint32_t empty = match(g, kEmpty);
+            if (empty) {
+                found = false;
+                return &slots_[g * kGroupSize + __builtin_ctz(empty)];
+            }
+            g = (g + step) & mask;
+        }
+    }
+
+    void alloc(uint32_t ngroups) {
+        ngroups_ = ngroups;
+        log_ngroups_ = __builtin_ctz(ngroups);
+        int ret = posix_memalign((void**)&ctrl_, JOS_CLINE, capacity());
+        assert(ret == 0);
+        ret = posix_memalign((void**)&slots_, JOS_CLINE,
+                capacity() * sizeof(slot));
+        assert(ret == 0);
+        memset(ctrl_, kEmpty, capacity());
+    }
+
+    /* @brief: double the table, reinserting by the stored hashes */
+    void grow() {
+        int8_t* old_ctrl = ctrl_;
+        slot* old_slots = slots_;
+        uint64_t old_cap = capacity();
+        alloc(ngroups_ * 2);
+        for (uint64_t i = 0; i < old_cap; ++i) {
+            if (old_ctrl[i] == kEmpty)
+                continue;
+            const slot& o = old_slots[i];
+            uint32_t mask = ngroups_ - 1;
+            uint32_t g = h1(o.hash) & mask;
+            uint32_t empty;
+            for (uint32_t step = 1; !(empty = match(g, kEmpty)); ++step)
+                g = (g + step) & mask;
+            uint64_t j = g * kGroupSize + __builtin_ctz(empty);
+            ctrl_[j] = old_ctrl[i];
+            slots_[j] = o;
+        }
+        free(old_ctrl);
+        free(old_slots);
+    }
+
+    int8_t* ctrl_;
+    slot* slots_;
+    uint32_t ngroups_;
+    uint32_t log_ngroups_;
+    uint64_t size_;
+};
+
+#endif  // OA_TABLE_HH_
@@ -22,25 +22,21 @@
 #include <algorithm>
 #include <ctype.h>
 #include "mr-types.hh"
+#include "chunk_reader.hh"
 #include <asm/mman.h>
 
 struct overlap_splitter {
     overlap_splitter(char *d, size_t size, size_t nsplit)
-        : d_(d), size_(size), nsplit_(nsplit), pos_(0), overlap_(1024) {
+        : r_(NULL), d_(d), size_(size), nsplit_(nsplit), pos_(0),
+          guided_(nsplit == 0), overlap_(1024) {
     }
     overlap_splitter(const char *f, size_t nsplit) :
-            f_(NULL), nsplit_(nsplit), pos_(0), overlap_(1024) {
-        f_ = fopen(f, "r");
-        assert(f_);
-        fseek(f_, 0, SEEK_END);
-        size_ = ftell(f_);
-        rewind(f_);
-
-        pthread_mutex_init(&flock_, NULL);
+            r_(new chunk_reader(f)), nsplit_(nsplit), pos_(0),
+            guided_(nsplit == 0), overlap_(1024) {
+        size_ = r_->size();
     }
     ~overlap_splitter() {
-        fclose(f_);
-        pthread_mutex_destroy(&flock_);
+        delete r_;
     }
     size_t overlap() const {
         return overlap_;
@@ -52,33 +48,18 @@ struct overlap_splitter {
     }
 
   private:
-    FILE* f_;
-    pthread_mutex_t flock_;
+    chunk_reader* r_;
     char *d_;
     size_t size_;
     int nsplit_;
     size_t pos_;
+    // shrink the splits towards the end unless the caller chose nsplit
+    const bool guided_;
     const size_t overlap_;
 };
 
 bool overlap_splitter::get_split_chunk(split_t* ma) {
-    if (ma->chunk_end_offset >= ma->split_end_offset)
-        return false;
-    pthread_mutex_lock(&flock_);
-    // seek to end of current chunk
-    fseek(f_, ma->chunk_end_offset, SEEK_SET);
-    // read in buffer
-    size_t read_length = std::min(ma->kBufferSize,
-            ma->split_end_offset - ma->chunk_end_offset);
-    size_t ret = fread(ma->data, sizeof(char), read_length, f_);
-    pthread_mutex_unlock(&flock_);
-    if (ret != read_length) {
-        perror("fread");
-        assert(false);
-    }
-    ma->chunk_start_offset = ma->chunk_end_offset;
-    ma->chunk_end_offset += read_length;
-    return true;
+    return r_->read_chunk(ma);
 }
 
 bool overlap_splitter::split(split_t *ma, int ncores, const char *stop, size_t align) {
@@ -92,37 +73,38 @@ bool overlap_splitter::split(split_t *ma, int ncores, const char *stop, size_t a
     if (pos_ >= size_)
         return false;
     size_t req_length = size_ / nsplit_ + 1;
-    size_t length = std::min(size_ - pos_, req_length);
+    size_t length = guided_ ?
+        guided_split_length(size_ - pos_, req_length, ncores) :
+        std::min(size_ - pos_, req_length);
 
     ma->split_start_offset = ma->chunk_start_offset = ma->chunk_end_offset = pos_;
     ma->split_end_offset = pos_ + length;
     pos_ += length;
     if (size_ - pos_ > 0) { // if not last chunk, add overlap
-        ma->split_end_offset += overlap_;
-    }
-
-    get_split_chunk(ma);
+        ma->split_end_offset = std::min(ma->split_end_offset + overlap_,
+                size_);
+    }
+    ma->overlap_length = ma->split_end_offset - pos_;
+    ma->input_length = size_;
+    // the chunks are loaded by get_split_chunk() in the map phase
+    ma->from_file = true;
+    if (r_)
+        r_->read_ahead(ma);
     return true;
 }
 
 struct large_overlap_splitter {
     large_overlap_splitter(char *d, size_t size, size_t nsplit)
-        : d_(d), size_(size), nsplit_(nsplit), pos_(0),
-            overlap_(8388608) {
+        : r_(NULL), d_(d), size_(size), nsplit_(nsplit), pos_(0),
+            guided_(nsplit == 0), overlap_(8388608) {
     }
     large_overlap_splitter(const char *f, size_t nsplit) :
-            f_(NULL), nsplit_(nsplit), pos_(0), overlap_(8388608) {
-        f_ = fopen(f, "r");
-        assert(f_);
-        fseek(f_, 0, SEEK_END);
-        size_ = ftell(f_);
-        rewind(f_);
-
-        pthread_mutex_init(&flock_, NULL);
+            r_(new chunk_reader(f)), nsplit_(nsplit), pos_(0),
+            guided_(nsplit == 0), overlap_(8388608) {
+        size_ = r_->size();
     }
     ~large_overlap_splitter() {
-        fclose(f_);
-        pthread_mutex_destroy(&flock_);
+        delete r_;
     }
     size_t overlap() const {
         return overlap_;
@@ -134,33 +116,18 @@ struct large_overlap_splitter {
     }
 
   private:
-    FILE* f_;
-    pthread_mutex_t flock_;
+    chunk_reader* r_;
     char *d_;
     size_t size_;
     int nsplit_;
     size_t pos_;
+    // shrink the splits towards the end unless the caller chose nsplit
+    const bool guided_;
     const size_t overlap_;
 };
 
 bool large_overlap_splitter::get_split_chunk(split_t* ma) {
-    if (ma->chunk_end_offset >= ma->split_end_offset)
-        return false;
-    pthread_mutex_lock(&flock_);
-    // seek to end of current chunk
-    fseek(f_, ma->chunk_end_offset, SEEK_SET);
-    // read in buffer
-    size_t read_length = std::min(ma->kBufferSize,
-            ma->split_end_offset - ma->chunk_end_offset);
-    size_t ret = fread(ma->data, sizeof(char), read_length, f_);
-    pthread_mutex_unlock(&flock_);
-    if (ret != read_length) {
-        perror("fread");
-        assert(false);
-    }
-    ma->chunk_start_offset = ma->chunk_end_offset;
-    ma->chunk_end_offset += read_length;
-    return true;
+    return r_->read_chunk(ma);
 }
 
 bool large_overlap_splitter::split(split_t *ma, int ncores,
@@ -175,16 +142,23 @@ bool large_overlap_splitter::split(split_t *ma, int ncores,
     if (pos_ >= size_)
         return false;
     size_t req_length = size_ / nsplit_ + 1;
-    size_t length = std::min(size_ - pos_, req_length);
+    size_t length = guided_ ?
+        guided_split_length(size_ - pos_, req_length, ncores) :
+        std::min(size_ - pos_, req_length);
 
     ma->split_start_offset = ma->chunk_start_offset = ma->chunk_end_offset = pos_;
     ma->split_end_offset = pos_ + length;
     pos_ += length;
     if (size_ - pos_ > 0) { // if not last chunk, add overlap
-        ma->split_end_offset += overlap_;
-    }
-
-    get_split_chunk(ma);
+        ma->split_end_offset = std::min(ma->split_end_offset + overlap_,
+                size_);
+    }
+    ma->overlap_length = ma->split_end_offset - pos_;
+    ma->input_length = size_;
+    // the chunks are loaded by get_split_chunk() in the map phase
+    ma->from_file = true;
+    if (r_)
+        r_->read_ahead(ma);
     return true;
 }
 
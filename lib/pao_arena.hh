@@ -0,0 +1,93 @@
+#ifndef PAO_ARENA_HH_
+#define PAO_ARENA_HH_ 1
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "bench.hh"
+#include "PartialAgg.h"
+
+/* @brief: Bump allocator for the PAOs an aggregator creates for new keys.
+ * PAOs are carved out of large chunks taken straight from the OS and are
+ * only ever given back all at once, so dropping N aggregated PAOs costs
+ * O(#chunks) instead of N deletes. Only usable with Operations that have a
+ * fixed PAO size and allow arena allocation (see
+ * Operations::arenaAllocatable()). Not thread-safe: every aggregator thread
+ * owns its own arena. */
+struct pao_arena {
+    explicit pao_arena(const Operations* ops) :
+            ops_(ops), stride_(round_up(ops->paoSize(), sizeof(void*))),
+            cur_(NULL), left_(0), spare_(NULL), npaos_(0) {
+        assert(stride_ > 0 && stride_ <= kChunkSize);
+    }
+    ~pao_arena() {
+        release();
+    }
+
+    /* @brief: construct an empty PAO in the arena */
+    PartialAgg* create() {
+        if (spare_) {
+            PartialAgg* p = spare_;
+            spare_ = NULL;
+            return p;
+        }
+        if (left_ < stride_)
+            new_chunk();
+        void* mem = cur_;
+        cur_ += stride_;
+        left_ -= stride_;
+        ++npaos_;
+        return ops_->constructPAO(mem);
+    }
+
+    /* @brief: hand back a PAO from create() that was never published. It
+     * is returned by the next create(). */
+    void recycle(PartialAgg* p) {
+        assert(!spare_);
+        spare_ = p;
+    }
+
+    /* @brief: free every PAO created so far. Destructors are not run. */
+    void release() {
+        for (uint32_t i = 0; i < chunks_.size(); ++i)
+            munmap(chunks_[i], kChunkSize);
+        chunks_.clear();
+        cur_ = NULL;
+        left_ = 0;
+        spare_ = NULL;
+        npaos_ = 0;
+    }
+
+    uint64_t num_paos() const {
+        return npaos_;
+    }
+
+  private:
+    void new_chunk() {
+        void* c = mmap(NULL, kChunkSize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(c != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+        // best effort; falls back to small pages
+        madvise(c, kChunkSize, MADV_HUGEPAGE);
+#endif
+        chunks_.push_back(c);
+        cur_ = (char*)c;
+        left_ = kChunkSize;
+    }
+
+    static const size_t kChunkSize = 2 * 1024 * 1024;
+
+    const Operations* ops_;
+    const size_t stride_;
+    char* cur_;
+    size_t left_;
+    PartialAgg* spare_;
+    uint64_t npaos_;
+    std::vector<void*> chunks_;
+};
+
+#endif  // PAO_ARENA_HH_
@@ -16,50 +16,110 @@
 #include "mr-types.hh"
 #include "bench.hh"
 #include "cpumap.hh"
+#include "futex.hh"
 #include "threadinfo.hh"
+#include "topology.hh"
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
+#include <algorithm>
 
+/* @brief: one pooled thread. The thread spins for a while waiting for its
+ * next task, then parks on a futex, so a pool that lives across phases and
+ * jobs costs no CPU while idle. The spin budget adapts: it grows while
+ * tasks keep arriving within it and shrinks while the thread ends up
+ * parking anyway. Waiting for the task to finish works the same way. */
 struct  __attribute__ ((aligned(JOS_CLINE))) thread_pool_t {
-    void *volatile a_;
-    void *(*volatile f_) (void *);
-    volatile char pending_;
+    enum { kMinSpin = 1 << 6, kMaxSpin = 1 << 14 };
+
+    void *a_;
+    void *(*f_) (void *);
     pthread_t tid_;
-    volatile bool running_;
+    // set by set_task, cleared by the pool thread once it takes the task
+    int pending_;
+    // set by set_task, cleared by the pool thread once the task returns
+    int running_;
+    // threads parked on pending_ and running_
+    int nwaiters_;
+    uint32_t task_spin_;
+    uint32_t finish_spin_;
 
     template <typename T>
     void set_task(void *arg, T &f) {
         a_ = arg;
         f_ = f;
-        mfence();
-        pending_ = true;
+        // running_ is set here rather than by the pool thread, so that
+        // wait_finish() cannot slip in before the task has started
+        __atomic_store_n(&running_, 1, __ATOMIC_RELAXED);
+        wake(&pending_, 1);
     }
 
     void wait_finish() {
-        while (running_)
-            nop_pause();
+        wait_while(&running_, 1, finish_spin_);
     }
 
-    void wait_running() {
-        while (pending_)
-            nop_pause();
-    }
     void run_next_task() {
-        while (!pending_)
-            nop_pause();
-        running_ = true;
-        pending_ = false;
+        wait_while(&pending_, 0, task_spin_);
+        __atomic_store_n(&pending_, 0, __ATOMIC_RELAXED);
         f_(a_);
-        running_ = false;
+        wake(&running_, 0);
+    }
+
+  private:
+    /* @brief: store @v to @addr, with release semantics, and wake whoever
+     * is parked on it */
+    void wake(int *addr, int v) {
+        __atomic_store_n(addr, v, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&nwaiters_, __ATOMIC_SEQ_CST))
+            futex_wake(addr, INT_MAX);
+    }
+
+    /* @brief: wait, with acquire semantics, while *@addr == @v */
+    void wait_while(int *addr, int v, uint32_t &spin) {
+        if (!spin)
+            spin = kMinSpin;
+        for (uint32_t i = 0; i < spin; ++i) {
+            if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != v) {
+                spin = std::min<uint32_t>(spin * 2, kMaxSpin);
+                return;
+            }
+            nop_pause();
+        }
+        spin = std::max<uint32_t>(spin / 2, kMinSpin);
+        while (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == v) {
+            __atomic_add_fetch(&nwaiters_, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == v)
+                futex_wait(addr, v);
+            __atomic_sub_fetch(&nwaiters_, 1, __ATOMIC_SEQ_CST);
+        }
     }
 };
 
 namespace {
 
+// auxiliary threads for the aggregators; they are not bound to a core
+enum { max_aux = JOS_NCPU * 4 };
+
+struct aux_task {
+    void *(*f)(void *);
+    void *arg;
+    bool pin;
+    cpu_set_t cset;
+    // affinity of the thread when it was created, restored for tasks
+    // that don't ask for pinning
+    bool pinned;
+    cpu_set_t initial;
+};
+
 thread_pool_t tp_[JOS_NCPU];
 bool tp_created_ = false;
 int ncore_ = 0;
-cpu_set_t cset1, cset2;
+
+thread_pool_t aux_[max_aux];
+aux_task aux_tasks_[max_aux];
+bool aux_used_[max_aux];
+int naux_ = 0;
+pthread_mutex_t aux_mu_ = PTHREAD_MUTEX_INITIALIZER;
 
 void *mthread_exit(void *) {
     pthread_exit(NULL);
@@ -71,6 +131,40 @@ void *mthread_entry(void *args) {
     while (true)
         tp_[ti->cur_core_].run_next_task();
 }
+
+void *aux_entry(void *args) {
+    int h = ptr2int<int>(args);
+    pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t),
+            &aux_tasks_[h].initial);
+    aux_tasks_[h].pinned = false;
+    while (true)
+        aux_[h].run_next_task();
+}
+
+void *aux_run(void *args) {
+    aux_task* t = &aux_tasks_[ptr2int<int>(args)];
+    if (t->pin)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &t->cset);
+    else if (t->pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                &t->initial);
+    t->pinned = t->pin;
+    return t->f(t->arg);
+}
+
+void create_worker(int i) {
+    if (i == main_core)
+        tp_[i].tid_ = pthread_self();
+    else {
+        int r = pthread_create(&tp_[i].tid_, NULL, mthread_entry, int2ptr(i));
+        if (r)
+            eprint("pthread_create: %s\n", strerror(r));
+    }
+    cpu_set_t cset;
+    CPU_ZERO(&cset);
+    CPU_SET(cpumap_physical_cpuid(i), &cset);
+    pthread_setaffinity_np(tp_[i].tid_, sizeof(cpu_set_t), &cset);
+}
 }
 
 void mthread_create(pthread_t * tid, int lid, void *(*start_routine) (void *),
@@ -81,7 +175,6 @@ void mthread_create(pthread_t * tid, int lid, void *(*start_routine) (void *),
     else {
         tp_[lid].wait_finish();
         tp_[lid].set_task(arg, start_routine);
-        tp_[lid].wait_running();
     }
 }
 
@@ -91,44 +184,68 @@ void mthread_join(pthread_t tid, int lid, void **retval) {
         *retval = 0;
 }
 
+int mthread_create_aux(void *(*start_routine) (void *), void *arg,
+        const cpu_set_t* cset) {
+    pthread_mutex_lock(&aux_mu_);
+    int h = 0;
+    while (h < naux_ && aux_used_[h])
+        ++h;
+    assert(h < max_aux);
+    if (h == naux_) {
+        int r = pthread_create(&aux_[h].tid_, NULL, aux_entry, int2ptr(h));
+        if (r)
+            eprint("pthread_create: %s\n", strerror(r));
+        ++naux_;
+    }
+    aux_used_[h] = true;
+    pthread_mutex_unlock(&aux_mu_);
+
+    aux_task* t = &aux_tasks_[h];
+    t->f = start_routine;
+    t->arg = arg;
+    t->pin = cset != NULL;
+    if (cset)
+        t->cset = *cset;
+    aux_[h].set_task(int2ptr(h), aux_run);
+    return h;
+}
+
+void mthread_join_aux(int h) {
+    aux_[h].wait_finish();
+    pthread_mutex_lock(&aux_mu_);
+    aux_used_[h] = false;
+    pthread_mutex_unlock(&aux_mu_);
+}
+
 void mthread_init(int ncore) {
-    if (tp_created_)
+    if (tp_created_) {
+        // the pool persists across phases and jobs; grow it if a phase
+        // needs more workers
+        for (; ncore_ < ncore; ++ncore_)
+            create_worker(ncore_);
         return;
-
-    // eeks. specific to jedi nodes
-    CPU_ZERO(&cset1);
-    CPU_ZERO(&cset2);
-    uint32_t i;
-    for (i = 0; i < 6; ++i)
-        CPU_SET(i, &cset1);
-    for (i = 12; i < 18; ++i)
-        CPU_SET(i, &cset1);
-    for (i = 6; i < 12; ++i)
-        CPU_SET(i, &cset2);
-    for (i = 18; i < 24; ++i)
-        CPU_SET(i, &cset2);
+    }
 
     threadinfo *ti = threadinfo::current();
+    // workers are placed by the topology policy (see topology.hh)
     cpumap_init();
+    topology::get().print(stderr);
     ncore_ = ncore;
     ti->cur_core_ = main_core;
     assert(affinity_set(cpumap_physical_cpuid(main_core)) == 0);
     tp_created_ = true;
     bzero(tp_, sizeof(tp_));
-    for (int i = 0; i < ncore_; ++i) {
-        if (i == main_core)
-            tp_[i].tid_ = pthread_self();
-        else
-            assert(pthread_create(&tp_[i].tid_, NULL, mthread_entry, int2ptr(i)) == 0);
-        if (i % 2 == 0) {
-            pthread_setaffinity_np(tp_[i].tid_, sizeof(cpu_set_t), &cset1);
-        } else {
-            pthread_setaffinity_np(tp_[i].tid_, sizeof(cpu_set_t), &cset2);
-        }
-    }
+    for (int i = 0; i < ncore_; ++i)
+        create_worker(i);
 }
 
 void mthread_finalize(void) {
+    for (int i = 0; i < naux_; ++i) {
+        aux_[i].wait_finish();
+        aux_[i].set_task(NULL, mthread_exit);
+        pthread_join(aux_[i].tid_, NULL);
+    }
+    naux_ = 0;
     if (!tp_created_)
         return;
     for (int i = 0; i < ncore_; ++i)
@@ -16,11 +16,20 @@
 #define THREAD_HH_ 1
 
 #include <pthread.h>
+#include <sched.h>
 #include <inttypes.h>
 
+/* @brief: make sure the pool has workers for cores 0 .. ncore - 1. The
+ * pool lives until mthread_finalize(), across phases and jobs. */
 void mthread_init(int ncore);
 void mthread_finalize(void);
 void mthread_create(pthread_t * tid, int lid,
 		    void *(*start_routine) (void *), void *arg);
 void mthread_join(pthread_t tid, int lid, void **exitcode);
+/* @brief: run start_routine(arg) on a pooled thread that is not one of
+ * the per-core workers, e.g. an aggregator. If @cset is not NULL, the
+ * thread is pinned to it first. Returns a handle for mthread_join_aux(). */
+int mthread_create_aux(void *(*start_routine) (void *), void *arg,
+        const cpu_set_t* cset = NULL);
+void mthread_join_aux(int handle);
 #endif
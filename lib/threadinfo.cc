@@ -15,5 +15,5 @@
 #include "threadinfo.hh"
 
 bool threadinfo::created_ = false;
-pthread_key_t threadinfo::key_;
+__thread threadinfo threadinfo::ti_;
 
@@ -15,21 +15,16 @@
 #ifndef THREADINFO_HH_
 #define THREADINFO_HH_ 1
 
-#include <pthread.h>
 #include <assert.h>
-#include <stdlib.h>
+#include <inttypes.h>
 
+/* @brief: per-thread state, in initial-exec TLS so that current() is a
+ * single thread-pointer-relative address computation */
 struct threadinfo {
     static threadinfo *current() {
-        threadinfo *ti = (threadinfo *)pthread_getspecific(key_);
-        if (!ti) {
-            ti = (threadinfo *)malloc(sizeof(threadinfo));
-            pthread_setspecific(key_, ti);
-        }
-        return ti;
+        return &ti_;
     }
     static void initialize() {
-        assert(pthread_key_create(&key_, free) == 0);
         created_ = true;
     }
     static bool initialized() {
@@ -38,9 +33,13 @@ struct threadinfo {
 
     int cur_reduce_task_;
     int cur_core_;
+    // the map manager whose buffer slots for this core are cached in
+    // slots_ (see map_manager::core_slots()); 0 if none
+    uint64_t slot_owner_;
+    void* slots_;
   private:
     static bool created_;
-    static pthread_key_t key_;
+    static __thread threadinfo ti_ __attribute__((tls_model("initial-exec")));
 };
 
 #endif
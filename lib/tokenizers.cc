@@ -0,0 +1,260 @@
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "tokenizers.hh"
+
+namespace {
+// [0-9A-Za-z] as in isalnum() for the C locale, without the table lookup
+inline bool is_alnum(unsigned char c) {
+    return (unsigned char)((c | 0x20) - 'a') < 26 ||
+        (unsigned char)(c - '0') < 10;
+}
+
+uint64_t classify_scalar(const char* p) {
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < 64; ++i)
+        bits |= (uint64_t)is_alnum(p[i]) << i;
+    return bits;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// as is_alnum(); the unsigned compares c - lo < n become signed ones by
+// biasing both sides by 0x80
+__attribute__ ((target("sse2")))
+uint64_t classify_sse2(const char* p) {
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i a = _mm_set1_epi8('a');
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nalpha = _mm_set1_epi8(26 - 128);
+    const __m128i ndigit = _mm_set1_epi8(10 - 128);
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < 64; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i alpha = _mm_cmpgt_epi8(nalpha, _mm_xor_si128(
+                _mm_sub_epi8(_mm_or_si128(v, lower), a), bias));
+        __m128i digit = _mm_cmpgt_epi8(ndigit, _mm_xor_si128(
+                _mm_sub_epi8(v, zero), bias));
+        bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                _mm_or_si128(alpha, digit)) << i;
+    }
+    return bits;
+}
+
+__attribute__ ((target("avx2")))
+uint64_t classify_avx2(const char* p) {
+    const __m256i bias = _mm256_set1_epi8((char)0x80);
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    const __m256i a = _mm256_set1_epi8('a');
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i nalpha = _mm256_set1_epi8(26 - 128);
+    const __m256i ndigit = _mm256_set1_epi8(10 - 128);
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < 64; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i alpha = _mm256_cmpgt_epi8(nalpha, _mm256_xor_si256(
+                _mm256_sub_epi8(_mm256_or_si256(v, lower), a), bias));
+        __m256i digit = _mm256_cmpgt_epi8(ndigit, _mm256_xor_si256(
+                _mm256_sub_epi8(v, zero), bias));
+        bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                _mm256_or_si256(alpha, digit)) << i;
+    }
+    return bits;
+}
+#endif
+
+split_word::classify_fn pick_classifier() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return classify_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return classify_sse2;
+#endif
+    return classify_scalar;
+}
+}
+
+split_word::classify_fn split_word::classifier() {
+    static classify_fn f = pick_classifier();
+    return f;
+}
+
+split_reads::code_tables::code_tables() {
+    for (int c = 0; c < 256; ++c)
+        upper[c] = toupper(c);
+    upper[(uint8_t)'\r'] = 0;
+    memset(base, kNotBase, sizeof(base));
+    const char* bases = "ACGT";
+    for (uint8_t i = 0; i < 4; ++i) {
+        base[(uint8_t)bases[i]] = i;
+        base[(uint8_t)tolower(bases[i])] = i;
+    }
+}
+
+const split_reads::code_tables& split_reads::tables() {
+    static code_tables t;
+    return t;
+}
+
+bool split_reads::skip_line() {
+    const char* p = at(off_);
+    const char* end = at(ma_->chunk_end_offset);
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    if (!nl) {
+        off_ = ma_->chunk_end_offset;
+        return false;
+    }
+    off_ += nl + 1 - p;
+    return true;
+}
+
+void split_reads::append(const char* p, const char* end) {
+    if (len_ + (end - p) > cap_) {
+        cap_ = std::max(cap_ * 2, len_ + (end - p));
+        buf_ = (char*)realloc(buf_, cap_);
+        assert(buf_);
+    }
+    for (; p < end; ++p)
+        if (uint8_t c = upper_[(uint8_t)*p])
+            buf_[len_++] = c;
+}
+
+bool split_reads::extend() {
+    if (ma_->split_end_offset >= ma_->input_length)
+        return false;
+    size_t n = std::min(split_t::kBufferSize,
+            ma_->input_length - ma_->split_end_offset);
+    ma_->split_end_offset += n;
+    ma_->overlap_length += n;
+    return true;
+}
+
+bool split_reads::next(const char*& seq, size_t& len) {
+    for (;;) {
+        if (state_ == kDone)
+            return false;
+        if (off_ >= ma_->chunk_end_offset) {
+            if (ma_->chunk_end_offset < ma_->split_end_offset)
+                return false;
+            // the split ends inside a read it owns: read on into the next
+            // split's range until the read ends
+            if (in_record() && extend())
+                return false;
+            // end of the input: a read cut off by it is taken as is
+            state_ = kDone;
+            return take(seq, len);
+        }
+        const char* p = at(off_);
+        const char* end = at(ma_->chunk_end_offset);
+        switch (state_) {
+            case kSync:
+                if (skip_line())
+                    state_ = kSyncLine;
+                break;
+            case kSyncLine:
+                if (format_ == FASTA) {
+                    if (off_ > owned_end_)
+                        state_ = kDone;
+                    else
+                        state_ = *p == '>' ? kLineStart : kSync;
+                    break;
+                }
+                if (*p == '+' && sync_at_[0] != kNoLine) {
+                    // a header two lines back, and its sequence in buf_
+                    sync_at_[0] = sync_at_[1] = kNoLine;
+                    pending_ = true;
+                    state_ = kLineStart;
+                    break;
+                }
+                sync_at_[0] = sync_at_[1];
+                sync_at_[1] = *p == '@' && off_ <= owned_end_ ? off_ :
+                        kNoLine;
+                if (off_ > owned_end_ && sync_at_[0] == kNoLine) {
+                    state_ = kDone;
+                    break;
+                }
+                len_ = 0;
+                state_ = kSyncSeq;
+                break;
+            case kSyncSeq: {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                append(p, nl ? nl : end);
+                if (nl) {
+                    off_ += nl + 1 - p;
+                    state_ = kSyncLine;
+                } else {
+                    off_ = ma_->chunk_end_offset;
+                }
+                break;
+            }
+            case kLineStart:
+                if (format_ == FASTQ && pending_) {
+                    if (*p != '+') {
+                        state_ = kSeq;
+                        break;
+                    }
+                    qual_left_ = len_;
+                    state_ = kPlus;
+                    return take(seq, len);
+                }
+                if (*p == (format_ == FASTA ? '>' : '@')) {
+                    // the newline before the record is at off_ - 1
+                    state_ = off_ > owned_end_ ? kDone : kHeader;
+                    if (take(seq, len))
+                        return true;
+                } else if (pending_) {
+                    state_ = kSeq;
+                } else {
+                    state_ = kSkipLine;
+                }
+                break;
+            case kHeader:
+                if (skip_line()) {
+                    pending_ = true;
+                    len_ = 0;
+                    state_ = kLineStart;
+                }
+                break;
+            case kSeq: {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                append(p, nl ? nl : end);
+                if (nl) {
+                    off_ += nl + 1 - p;
+                    state_ = kLineStart;
+                } else {
+                    off_ = ma_->chunk_end_offset;
+                }
+                break;
+            }
+            case kPlus:
+                if (skip_line())
+                    state_ = kQual;
+                break;
+            case kQual: {
+                // as many quality values as there were bases, on one line
+                // or more
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                const char* e = nl ? nl : end;
+                if (nl && e > p && e[-1] == '\r')
+                    --e;
+                size_t n = std::min(qual_left_, (size_t)(e - p));
+                qual_left_ -= n;
+                off_ += n;
+                if (!qual_left_)
+                    state_ = kSkipLine;
+                else if (nl)
+                    off_ += nl + 1 - (p + n);
+                break;
+            }
+            case kSkipLine:
+                if (skip_line())
+                    state_ = kLineStart;
+                break;
+            default:
+                assert(0);
+        }
+    }
+}
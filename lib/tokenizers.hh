@@ -1,5 +1,6 @@
 #ifndef TOKENIZER_HH
 #define TOKENIZER_HH
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <algorithm>
@@ -7,55 +8,85 @@
 #include "mr-types.hh"
 #include <asm/mman.h>
 
+/* @brief: Splits a chunk into words, i.e. maximal runs of [0-9A-Za-z].
+ * The chunk is classified 64 bytes at a time into a bitmask of word
+ * characters (with AVX2 or SSE2 where the CPU has it, see tokenizers.cc),
+ * so word boundaries are found with bit scans. The chunk is not modified. */
 struct split_word {
+    typedef uint64_t (*classify_fn)(const char* p);
+
     split_word(split_t *ma) :
-            ma_(ma), len_(0),
-            bytewise_(true) {
+            ma_(ma), data_(ma->data),
+            len_(ma->chunk_end_offset - ma->chunk_start_offset), pos_(0),
+            base_(0), bits_(0), classify_(classifier()) {
         assert(ma_ && ma_->data);
-        str_ = ma_->data;
+        load(0);
+    }
+
+    /* @brief: the next word, as a view into the chunk. Returns false at
+     * the end of the chunk. */
+    bool next(const char*& word, size_t& len) {
+        size_t start = find(pos_, true);
+        if (start == len_)
+            return false;
+        pos_ = find(start, false);
+        word = data_ + start;
+        len = pos_ - start;
+        return true;
     }
 
+    /* @brief: copy the next word to @k, NUL terminated and truncated to
+     * @maxlen - 1 characters */
     bool fill(char *k, size_t maxlen, size_t &klen) {
-        char* spl;
-        size_t chunk_length = ma_->chunk_end_offset -
-            ma_->chunk_start_offset;
+        const char* w;
+        if (!next(w, klen))
+            return false;
+        klen = std::min(klen, maxlen - 1);
+        memcpy(k, w, klen);
+        k[klen] = 0;
+        return true;
+    }
 
-        if (bytewise_) {
-            char *d = ma_->data;
-            klen = 0;
-            for (; len_ < chunk_length && !isalnum(d[len_]); ++len_);
-            if (len_ == chunk_length) {
-                return false;
-            }
-            for (; len_ < chunk_length && isalnum(d[len_]); ++len_) {
-                k[klen++] = d[len_];
-            }
-            k[klen] = 0;
-            return true;
+  private:
+    /* @brief: the best classifier for this CPU: bit i of its result is
+     * set iff p[i] is a word character, for i < 64 */
+    static classify_fn classifier();
+
+    void load(size_t base) {
+        base_ = base;
+        if (len_ - base >= 64) {
+            bits_ = classify_(data_ + base);
+            return;
         }
+        // don't read past the chunk
+        char tail[64];
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, data_ + base, len_ - base);
+        bits_ = classify_(tail);
+    }
 
-        // split token
-//        spl = strtok_r(str_, " \t\n\r\0", &saveptr1);
-        spl = strtok_r(str_, " .-=_\t\n\r\'\"?,;`:!*()-\0\uFEFF", &saveptr1);
-        if (spl == NULL)
-            return false;
-        int l = strlen(spl);
-        strncpy(k, spl, l);
-        klen = l;
-        str_ = NULL;
-        if (spl + maxlen > ma_->data + chunk_length) {
-            bytewise_ = true;
-            len_ = (spl - ma_->data) + klen;
+    /* @brief: the first position from @pos on that is (@word) or is not
+     * a word character, or len_ */
+    size_t find(size_t pos, bool word) {
+        while (pos < len_) {
+            if (pos - base_ >= 64)
+                load(pos - pos % 64);
+            uint64_t m = (word ? bits_ : ~bits_) & (~0ULL << (pos - base_));
+            if (m)
+                return std::min(base_ + __builtin_ctzll(m), len_);
+            pos = base_ + 64;
         }
-        return true;
+        return len_;
     }
 
-  private:
     split_t* ma_;
-    char* str_;
-    char* saveptr1;
+    const char* data_;
     size_t len_;
-    bool bytewise_;
+    size_t pos_;
+    // bits_ classifies data_[base_, base_ + 64)
+    size_t base_;
+    uint64_t bits_;
+    classify_fn classify_;
 };
 
 struct split_record {
@@ -127,85 +158,212 @@ struct split_record {
     size_t overlap_;
 };
 
-struct split_kmer {
-    split_kmer(split_t *ma, size_t overlap, uint32_t k) :
-            ma_(ma), k_(k),
-            read_(NULL), read_offset_(0), len_(0), bytewise_(false),
-            overlap_(overlap) {
-        assert(ma_ && ma_->data);
-        str_ = ma_->data;
+/* @brief: Reads the FASTA or FASTQ records of a split, one chunk after the
+ * other, and hands out the sequence of every read in one piece: line
+ * breaks removed and upper-cased, so that the k-mer tokenizers below look
+ * at every base once. A read that spans chunks is carried over in a buffer.
+ * A split owns the records whose first line starts after a newline in
+ * [split_start_offset, split_end_offset - overlap_length), or at offset 0;
+ * the overlap after that only completes the last of them. A record that
+ * runs on past the overlap is followed to its end by moving
+ * split_end_offset further into the input (up to input_length), one chunk
+ * at a time, so the split that owns a long record sees all of it. FASTQ
+ * records are told from quality lines that start with '@' by the '+' line
+ * two lines further on, which assumes single-line sequences at the start
+ * of a split. */
+struct split_reads {
+    enum format_t {
+        FASTA,
+        FASTQ,
+    };
+
+    split_reads(split_t *ma, format_t format) :
+            ma_(ma), format_(format), off_(ma->split_start_offset),
+            owned_end_(ma->split_end_offset - ma->overlap_length),
+            state_(off_ > 0 ? kSync : kLineStart), pending_(false),
+            qual_left_(0), buf_(NULL), len_(0), cap_(0),
+            upper_(tables().upper) {
+        sync_at_[0] = sync_at_[1] = kNoLine;
+    }
+    ~split_reads() {
+        free(buf_);
+    }
 
-        // if it is not the first split, then move forward until we hit a
-        // newline. All kmers that start before the newline are the
-        // responsibility of the previous split
-        if (ma_->split_start_offset > 0) {
-            for (; *str_ != '\n'; ++str_);
-            ++str_;
-        }
-        // if this has landed us on a header line then move forward
-        // another line
-        if (*str_ == '>') {
-            for (; *str_ != '\n'; ++str_);
-            ++str_;
-        }
+    /* @brief: the sequence of the next read, valid until the next call.
+     * Returns false once the chunk loaded into the split is used up; the
+     * reads that continue into the next chunk follow once it is loaded. */
+    bool next(const char*& seq, size_t& len);
+
+    /* @brief: 0-3 for A, C, G and T in either case, kNotBase otherwise */
+    static const uint8_t* base_codes() {
+        return tables().base;
     }
+    enum { kNotBase = 4 };
 
-    bool fill(char *key, size_t maxlen, size_t &klen) {
-        size_t chunk_length = ma_->chunk_end_offset -
-            ma_->chunk_start_offset;
+  private:
+    enum state_t {
+        kSync,      // skip to the next line, then kSyncLine
+        kSyncLine,  // at a line start, looking for the first record
+        kSyncSeq,   // in a line that may be the sequence of a FASTQ record
+        kLineStart, // at a line start within the owned records
+        kHeader,    // in a header line
+        kSeq,       // in a sequence line
+        kPlus,      // in a FASTQ '+' line
+        kQual,      // in FASTQ quality lines
+        kSkipLine,  // skip to the next line, then kLineStart
+        kDone,
+    };
+    struct code_tables {
+        code_tables();
+        // upper-case, or 0 for bytes dropped from sequences
+        uint8_t upper[256];
+        uint8_t base[256];
+    };
+    static const code_tables& tables();
+
+    const char* at(size_t off) const {
+        return ma_->data + (off - ma_->chunk_start_offset);
+    }
+    // moves past the end of the current line; false if the chunk ends first
+    bool skip_line();
+    void append(const char* p, const char* end);
+    // whether the split has started a record it owns but not finished it
+    bool in_record() const {
+        return pending_ || state_ == kHeader || sync_at_[0] != kNoLine ||
+                sync_at_[1] != kNoLine;
+    }
+    // grows the split by a chunk; false at the end of the input
+    bool extend();
+    bool take(const char*& seq, size_t& len) {
+        if (!pending_)
+            return false;
+        pending_ = false;
+        seq = buf_;
+        len = len_;
+        return true;
+    }
 
-        // get the next read
-        if (!read_ || read_offset_ + k_ == read_length_) {
-            read_ = strtok_r(str_, ">", &saveptr1);
-            str_ = NULL;
-            if (!read_)
-                return false;
-            read_length_ = strlen(read_);
-            read_offset_ = 0;
-
-            bool are_we_in_header = false;
-            for (int test_len = 0; test_len < 4; ++test_len) {
-                char c = *(read_ + test_len);
-                if (c != 'A' && c != 'C' && c != 'G' && c != 'T') {
-                    are_we_in_header = true;
-                    break;
+    split_t* ma_;
+    const format_t format_;
+    // file offset of the next byte to look at
+    size_t off_;
+    const size_t owned_end_;
+    state_t state_;
+    // a read has started whose sequence is in buf_
+    bool pending_;
+    size_t qual_left_;
+    // FASTQ sync: the starts of the last two lines if they start with '@'
+    // in the owned range, else kNoLine; buf_ holds the line after them
+    enum { kNoLine = ~(size_t)0 };
+    size_t sync_at_[2];
+    char* buf_;
+    size_t len_;
+    size_t cap_;
+    const uint8_t* upper_;
+};
+
+/* @brief: Splits the reads of a split (see split_reads) into k-mers,
+ * handed out as views of k bases into the read. The window slides one base
+ * per k-mer; a base other than ACGT (e.g. a run of N) empties it. */
+struct split_kmer {
+    split_kmer(split_t *ma, uint32_t k, split_reads::format_t format) :
+            reads_(ma, format), k_(k), seq_(NULL), len_(0), pos_(0),
+            nbases_(0), codes_(split_reads::base_codes()) {
+        assert(k_ > 0);
+    }
+
+    /* @brief: the next k-mer. Returns false once the loaded chunk is used
+     * up (see split_reads::next()). */
+    bool next(const char*& kmer) {
+        for (;;) {
+            while (pos_ < len_) {
+                if (codes_[(uint8_t)seq_[pos_++]] == split_reads::kNotBase) {
+                    nbases_ = 0;
+                } else if (++nbases_ >= k_) {
+                    kmer = seq_ + pos_ - k_;
+                    return true;
                 }
             }
-            if (are_we_in_header) {
-                // jump forward until newline
-                for (; *(read_ + read_offset_) != '\n'; ++read_offset_);
-                ++read_offset_;
-            }
+            if (!reads_.next(seq_, len_))
+                return false;
+            pos_ = 0;
+            nbases_ = 0;
         }
+    }
 
-        klen = 0;
-        size_t ind = read_offset_++;
-        while (klen < k_) {
-            char c = read_[ind++];
-            if (c != '\n' && c != 'N')
-                key[klen++] = c;
-        }
+  private:
+    split_reads reads_;
+    const uint32_t k_;
+    const char* seq_;
+    size_t len_;
+    size_t pos_;
+    // ACGT bases since the last break; the k-mer is complete once this is k
+    uint64_t nbases_;
+    const uint8_t* codes_;
+};
 
-        // if we're close to the overlap zone, switch to bytewise (and
-        // non-modifying) mode
-        if (read_ + read_offset_ > ma_->data + chunk_length) {
-            if (read_[read_offset_] == '\n')
+/* @brief: As split_kmer, but the k-mers (k <= 32) are packed two bits per
+ * base, A=0 C=1 G=2 T=3, with the first base in the most significant bits,
+ * and rolled forward one base at a time. In canonical mode a k-mer and its
+ * reverse complement map to the smaller of the two encodings. */
+struct split_kmer_packed {
+    split_kmer_packed(split_t *ma, uint32_t k, bool canonical,
+            split_reads::format_t format) :
+            reads_(ma, format), k_(k), canonical_(canonical),
+            mask_(k >= 32 ? ~0ULL : (1ULL << (2 * k)) - 1),
+            shift_(2 * (k - 1)), seq_(NULL), len_(0), pos_(0), fwd_(0),
+            rev_(0), nbases_(0), codes_(split_reads::base_codes()) {
+        assert(k_ > 0 && k_ <= kMaxK);
+    }
+
+    /* @brief: the next k-mer. Returns false once the loaded chunk is used
+     * up (see split_reads::next()). */
+    bool next(uint64_t& kmer) {
+        for (;;) {
+            while (pos_ < len_) {
+                uint8_t c = codes_[(uint8_t)seq_[pos_++]];
+                if (c == split_reads::kNotBase) {
+                    nbases_ = 0;
+                    continue;
+                }
+                fwd_ = ((fwd_ << 2) | c) & mask_;
+                rev_ = (rev_ >> 2) | ((uint64_t)(3 - c) << shift_);
+                if (++nbases_ >= k_) {
+                    kmer = canonical_ && rev_ < fwd_ ? rev_ : fwd_;
+                    return true;
+                }
+            }
+            if (!reads_.next(seq_, len_))
                 return false;
+            pos_ = 0;
+            nbases_ = 0;
         }
-        return true;
     }
 
+    /* @brief: write the @k bases of @kmer and a NUL to @out */
+    static void decode(uint64_t kmer, uint32_t k, char* out) {
+        static const char bases[] = "ACGT";
+        for (uint32_t i = 0; i < k; ++i)
+            out[i] = bases[(kmer >> (2 * (k - 1 - i))) & 3];
+        out[k] = 0;
+    }
+
+    enum { kMaxK = 32 };
+
   private:
-    split_t* ma_;
-    uint32_t k_;
-    char* str_;
-    char* read_;
-    size_t read_length_;
-    size_t read_offset_;
-    char* saveptr1;
+    split_reads reads_;
+    const uint32_t k_;
+    const bool canonical_;
+    const uint64_t mask_;
+    const uint32_t shift_;
+    const char* seq_;
     size_t len_;
-    bool bytewise_;
-    size_t overlap_;
+    size_t pos_;
+    uint64_t fwd_;
+    uint64_t rev_;
+    // ACGT bases since the last break; the k-mer is complete once this is k
+    uint64_t nbases_;
+    const uint8_t* codes_;
 };
 
 struct split_large_record {
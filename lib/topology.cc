@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <numa.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+
+#include "topology.hh"
+
+namespace {
+const char* const kCpuDir = "/sys/devices/system/cpu";
+const char* const kNodeDir = "/sys/devices/system/node";
+
+// reads a single integer; returns @def if the file is missing
+int read_int(const char* path, int def) {
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return def;
+    int v;
+    if (fscanf(f, "%d", &v) != 1)
+        v = def;
+    fclose(f);
+    return v;
+}
+
+// parses a cpulist such as "0-5,12-17"; returns false if the file is missing
+bool read_cpulist(const char* path, std::vector<int>& ids) {
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return false;
+    char buf[4096];
+    bool ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+    if (!ok)
+        return false;
+    for (char* p = buf; *p && *p != '\n';) {
+        char* end;
+        long lo = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long hi = lo;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (long i = lo; i <= hi; ++i)
+            ids.push_back(i);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
+
+const char* policy_name(topology::policy_t p) {
+    switch (p) {
+        case topology::COMPACT:
+            return "compact";
+        case topology::SCATTER:
+            return "scatter";
+        default:
+            return "socket";
+    }
+}
+}
+
+topology::topology() : nsockets_(1) {
+    discover();
+    place();
+}
+
+const topology& topology::get() {
+    static topology t;
+    static policy_t placed = policy();
+    if (placed != policy()) {
+        t.place();
+        placed = policy();
+    }
+    return t;
+}
+
+topology::policy_t& topology::policy() {
+    static policy_t p = SOCKET;
+    return p;
+}
+
+bool topology::set_policy(const std::string& name) {
+    if (name == "compact")
+        policy() = COMPACT;
+    else if (name == "scatter")
+        policy() = SCATTER;
+    else if (name == "socket")
+        policy() = SOCKET;
+    else
+        return false;
+    return true;
+}
+
+void topology::discover() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+            CPU_SET(i, &allowed);
+    }
+    char path[256];
+    std::vector<int> online;
+    snprintf(path, sizeof(path), "%s/online", kCpuDir);
+    if (!read_cpulist(path, online)) {
+        discover_flat();
+        return;
+    }
+
+    for (size_t i = 0; i < online.size(); ++i) {
+        int id = online[i];
+        if (id >= CPU_SETSIZE || !CPU_ISSET(id, &allowed))
+            continue;
+        cpu c;
+        c.id = id;
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/physical_package_id",
+                kCpuDir, id);
+        c.socket = std::max(read_int(path, 0), 0);
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/core_id", kCpuDir, id);
+        c.core = read_int(path, id);
+        c.node = 0;
+        c.smt = 0;
+        cpus_.push_back(c);
+    }
+    if (cpus_.empty()) {
+        discover_flat();
+        return;
+    }
+
+    // NUMA nodes; a kernel without NUMA has no node directory
+    std::map<int, int> node_of;
+    if (DIR* d = opendir(kNodeDir)) {
+        while (struct dirent* e = readdir(d)) {
+            int node;
+            if (sscanf(e->d_name, "node%d", &node) != 1)
+                continue;
+            std::vector<int> ids;
+            // d_name may be up to NAME_MAX bytes, more than path holds
+            std::string list = std::string(kNodeDir) + "/" + e->d_name +
+                    "/cpulist";
+            read_cpulist(list.c_str(), ids);
+            for (size_t i = 0; i < ids.size(); ++i)
+                node_of[ids[i]] = node;
+        }
+        closedir(d);
+    }
+
+    // number the sockets densely and the SMT siblings of every core
+    std::map<int, int> socket_index;
+    std::map<std::pair<int, int>, int> siblings;
+    for (size_t i = 0; i < cpus_.size(); ++i) {
+        cpu& c = cpus_[i];
+        if (node_of.count(c.id))
+            c.node = node_of[c.id];
+        if (!socket_index.count(c.socket)) {
+            int n = socket_index.size();
+            socket_index[c.socket] = n;
+        }
+        c.smt = siblings[std::make_pair(c.socket, c.core)]++;
+    }
+    for (size_t i = 0; i < cpus_.size(); ++i) {
+        cpus_[i].socket = socket_index[cpus_[i].socket];
+        nodes_.push_back(cpus_[i].node);
+    }
+    nsockets_ = socket_index.size();
+    std::sort(nodes_.begin(), nodes_.end());
+    nodes_.erase(std::unique(nodes_.begin(), nodes_.end()), nodes_.end());
+}
+
+void topology::discover_flat() {
+    cpus_.clear();
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 0; i < std::max(n, 1L); ++i) {
+        cpu c;
+        c.id = i;
+        c.socket = 0;
+        c.core = i;
+        c.node = 0;
+        c.smt = 0;
+        cpus_.push_back(c);
+    }
+    nsockets_ = 1;
+    nodes_.assign(1, 0);
+}
+
+namespace {
+struct socket_major {
+    socket_major(const std::vector<int>& key, const std::vector<int>& minor)
+        : key_(key), minor_(minor) {}
+    bool operator()(uint32_t a, uint32_t b) const {
+        if (key_[a] != key_[b])
+            return key_[a] < key_[b];
+        return minor_[a] < minor_[b];
+    }
+    const std::vector<int>& key_;
+    const std::vector<int>& minor_;
+};
+}
+
+void topology::place() {
+    uint32_t n = cpus_.size();
+    // within a socket: physical cores first, then their SMT siblings
+    std::vector<int> socket(n), in_socket(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        socket[i] = cpus_[i].socket;
+        in_socket[i] = (cpus_[i].smt << 20) | cpus_[i].core;
+    }
+    order_.resize(n);
+    for (uint32_t i = 0; i < n; ++i)
+        order_[i] = i;
+    std::sort(order_.begin(), order_.end(), socket_major(socket, in_socket));
+    if (policy() == COMPACT)
+        return;
+
+    // deal the sockets out round-robin: order by rank within the socket
+    std::vector<int> rank(n);
+    for (uint32_t i = 0, r = 0; i < n; ++i) {
+        if (i && socket[order_[i]] != socket[order_[i - 1]])
+            r = 0;
+        rank[order_[i]] = r++;
+    }
+    std::sort(order_.begin(), order_.end(), socket_major(rank, socket));
+}
+
+int topology::worker_cpu(uint32_t i) const {
+    return cpus_[order_[i % order_.size()]].id;
+}
+
+int topology::home_node(uint32_t j, uint32_t n) const {
+    if (policy() != SOCKET || nodes_.size() < 2 || nodes_.size() < nsockets_)
+        return -1;
+    return nodes_[(uint64_t)j * nodes_.size() / std::max(n, 1U)];
+}
+
+void topology::aggregator_cpus(uint32_t j, uint32_t n, uint32_t nworkers,
+        cpu_set_t* cset) const {
+    CPU_ZERO(cset);
+    int node = home_node(j, n);
+    if (node >= 0) {
+        for (uint32_t i = 0; i < cpus_.size(); ++i)
+            if (cpus_[i].node == node)
+                CPU_SET(cpus_[i].id, cset);
+        return;
+    }
+    if (policy() == SOCKET) {
+        int s = (uint64_t)j * nsockets_ / std::max(n, 1U);
+        for (uint32_t i = 0; i < cpus_.size(); ++i)
+            if (cpus_[i].socket == s)
+                CPU_SET(cpus_[i].id, cset);
+        return;
+    }
+    // the CPUs left over by the map workers, if any
+    for (uint32_t i = nworkers; i < order_.size(); ++i)
+        CPU_SET(cpus_[order_[i]].id, cset);
+    if (!CPU_COUNT(cset))
+        all_cpus(cset);
+}
+
+void topology::all_cpus(cpu_set_t* cset) const {
+    CPU_ZERO(cset);
+    for (uint32_t i = 0; i < cpus_.size(); ++i)
+        CPU_SET(cpus_[i].id, cset);
+}
+
+void topology::print(FILE* f) const {
+    fprintf(f, "Topology: %u CPUs, %u sockets, %u nodes, placement %s\n",
+            ncpus(), nsockets_, nnodes(), policy_name(policy()));
+}
+
+numa_preferred::numa_preferred(int node) : set_(false) {
+    if (node >= 0 && numa_available() >= 0) {
+        numa_set_preferred(node);
+        set_ = true;
+    }
+}
+
+numa_preferred::~numa_preferred() {
+    if (set_)
+        numa_set_localalloc();
+}
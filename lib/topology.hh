@@ -0,0 +1,100 @@
+#ifndef TOPOLOGY_HH_
+#define TOPOLOGY_HH_ 1
+
+#include <sched.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+/* @brief: The sockets, cores and SMT siblings of the CPUs this process may
+ * run on, read once from /sys/devices/system/{cpu,node}. Places the map
+ * workers and the aggregator threads according to a process-wide policy,
+ * chosen with set_policy() before the application runs:
+ *  - compact: workers fill one socket before the next, physical cores
+ *             before SMT siblings; aggregators share the CPUs the workers
+ *             leave free
+ *  - scatter: workers go round-robin over the sockets, physical cores
+ *             before SMT siblings; aggregators as for compact
+ *  - socket:  workers as for scatter; the aggregators are divided evenly
+ *             over the NUMA nodes (or the sockets, if the kernel reports
+ *             fewer nodes) and each may run anywhere on its node. The
+ *             partition of an aggregator is homed on the same node (see
+ *             home_node()). This is the default. */
+struct topology {
+    enum policy_t {
+        COMPACT,
+        SCATTER,
+        SOCKET,
+    };
+
+    /* @brief: the topology of the machine, discovered on first use */
+    static const topology& get();
+
+    /* @brief: select the placement policy by name ("compact", "scatter"
+     * or "socket"). Returns false if the name is unknown. */
+    static bool set_policy(const std::string& name);
+
+    uint32_t ncpus() const {
+        return cpus_.size();
+    }
+    uint32_t nsockets() const {
+        return nsockets_;
+    }
+    uint32_t nnodes() const {
+        return nodes_.size();
+    }
+
+    /* @brief: the CPU for map worker @i */
+    int worker_cpu(uint32_t i) const;
+
+    /* @brief: fill @cset with the CPUs for aggregator @j of @n, given that
+     * @nworkers map workers are placed by worker_cpu() */
+    void aggregator_cpus(uint32_t j, uint32_t n, uint32_t nworkers,
+            cpu_set_t* cset) const;
+
+    /* @brief: the NUMA node whose memory should hold partition @j of @n,
+     * i.e. the node its aggregator runs on. -1 if the partitions have no
+     * home: a single node, or a policy that lets aggregators float. */
+    int home_node(uint32_t j, uint32_t n) const;
+
+    /* @brief: fill @cset with every CPU this process may run on */
+    void all_cpus(cpu_set_t* cset) const;
+
+    void print(FILE* f) const;
+
+  private:
+    struct cpu {
+        int id;
+        int socket;
+        int core;
+        int node;
+        // index among the SMT siblings of the core
+        int smt;
+    };
+
+    topology();
+    void discover();
+    void discover_flat();
+    void place();
+    static policy_t& policy();
+
+    std::vector<cpu> cpus_;
+    uint32_t nsockets_;
+    // the distinct NUMA nodes, ascending
+    std::vector<int> nodes_;
+    // worker i runs on cpus_[order_[i % order_.size()]]
+    std::vector<uint32_t> order_;
+};
+
+/* @brief: While in scope, memory the calling thread faults in is taken
+ * from NUMA node @node where possible. No-op for a node of -1 or without
+ * NUMA support. */
+struct numa_preferred {
+    explicit numa_preferred(int node);
+    ~numa_preferred();
+  private:
+    bool set_;
+};
+
+#endif  // TOPOLOGY_HH_
@@ -0,0 +1,179 @@
+#ifndef URING_HH_
+#define URING_HH_ 1
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* @brief: A minimal io_uring for asynchronous reads, driven through the raw
+ * system calls (no liburing). Not thread-safe: callers serialize
+ * submit_read() and reap(). */
+struct uring {
+    uring() : fd_(-1), sq_ring_(NULL), cq_ring_(NULL), sqes_(NULL),
+            sq_ring_size_(0), cq_ring_size_(0), sqes_size_(0) {
+    }
+    ~uring() {
+        if (sqes_)
+            munmap(sqes_, sqes_size_);
+        if (cq_ring_ && cq_ring_ != sq_ring_)
+            munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_)
+            munmap(sq_ring_, sq_ring_size_);
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    /* @brief: set up a ring with room for @entries submissions. Returns
+     * false if the kernel does not support (or forbids) io_uring or its
+     * reads. */
+    bool init(uint32_t entries) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd_ = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd_ < 0)
+            return false;
+        // kernels before 5.6 set up rings, but fail every IORING_OP_READ
+        // with -EINVAL; they fail the probe as well
+        if (!supports(IORING_OP_READ))
+            return false;
+
+        sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = p.cq_off.cqes +
+            p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            if (cq_ring_size_ > sq_ring_size_)
+                sq_ring_size_ = cq_ring_size_;
+            cq_ring_size_ = sq_ring_size_;
+        }
+        sq_ring_ = (char*)mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            sq_ring_ = NULL;
+            return false;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring_ = sq_ring_;
+        } else {
+            cq_ring_ = (char*)mmap(NULL, cq_ring_size_,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                    IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED) {
+                cq_ring_ = NULL;
+                return false;
+            }
+        }
+        sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ = (struct io_uring_sqe*)mmap(NULL, sqes_size_,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) {
+            sqes_ = NULL;
+            return false;
+        }
+
+        sq_head_ = (uint32_t*)(sq_ring_ + p.sq_off.head);
+        sq_tail_ = (uint32_t*)(sq_ring_ + p.sq_off.tail);
+        sq_mask_ = *(uint32_t*)(sq_ring_ + p.sq_off.ring_mask);
+        sq_entries_ = p.sq_entries;
+        sq_array_ = (uint32_t*)(sq_ring_ + p.sq_off.array);
+        cq_head_ = (uint32_t*)(cq_ring_ + p.cq_off.head);
+        cq_tail_ = (uint32_t*)(cq_ring_ + p.cq_off.tail);
+        cq_mask_ = *(uint32_t*)(cq_ring_ + p.cq_off.ring_mask);
+        cqes_ = (struct io_uring_cqe*)(cq_ring_ + p.cq_off.cqes);
+        return true;
+    }
+
+    /* @brief: start reading @len bytes at @off of @fd into @buf. @data is
+     * handed back by reap() once the read completes. */
+    void submit_read(int fd, char* buf, uint32_t len, uint64_t off,
+            void* data) {
+        uint32_t tail = *sq_tail_;
+        // every submission is handed to the kernel right away, so the
+        // ring is never full
+        assert(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) <
+                sq_entries_);
+        uint32_t i = tail & sq_mask_;
+        struct io_uring_sqe* sqe = &sqes_[i];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->off = off;
+        sqe->user_data = (uint64_t)(uintptr_t)data;
+        sq_array_[i] = i;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, fd_, 1, 0, 0, NULL, 0);
+        } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+        assert(ret == 1);
+    }
+
+    /* @brief: wait for at least one read to complete, then fill @data and
+     * @res (bytes read or -errno) with up to @max completions. Returns the
+     * number of completions. */
+    uint32_t reap(void** data, int* res, uint32_t max) {
+        uint32_t head = *cq_head_;
+        while (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            int ret = syscall(__NR_io_uring_enter, fd_, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+            assert(ret >= 0 || errno == EINTR);
+        }
+        uint32_t n = 0;
+        uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail && n < max; ++head, ++n) {
+            struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+            data[n] = (void*)(uintptr_t)cqe->user_data;
+            res[n] = cqe->res;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+  private:
+    /* @brief: whether the ring takes @opcode. Sets errno if not. */
+    bool supports(uint8_t opcode) {
+        enum { kProbeOps = 256 };
+        size_t len = sizeof(struct io_uring_probe) +
+            kProbeOps * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, len);
+        assert(probe);
+        int ret = syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE,
+                probe, kProbeOps);
+        bool ok = ret >= 0 && opcode <= probe->last_op &&
+            opcode < probe->ops_len &&
+            (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+        free(probe);
+        if (ret >= 0 && !ok)
+            errno = EOPNOTSUPP;
+        return ok;
+    }
+
+    int fd_;
+    char* sq_ring_;
+    char* cq_ring_;
+    struct io_uring_sqe* sqes_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    size_t sqes_size_;
+
+    uint32_t* sq_head_;
+    uint32_t* sq_tail_;
+    uint32_t sq_mask_;
+    uint32_t sq_entries_;
+    uint32_t* sq_array_;
+    uint32_t* cq_head_;
+    uint32_t* cq_tail_;
+    uint32_t cq_mask_;
+    struct io_uring_cqe* cqes_;
+};
+
+#endif  // URING_HH_
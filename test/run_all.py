@@ -1,6 +1,6 @@
 #!/usr/bin/python
 
-import subprocess, sys, os, multiprocessing
+import subprocess, sys, os, multiprocessing, random, re, tempfile
 
 commonArgs = '-q'
 sanityRun = True
@@ -38,6 +38,38 @@ def do_test(prog, args, sanityArgs = None, silent = False):
     else:
         failed += 1
 
+def test_kmer_splits():
+    # k-mer counts must not depend on how the input is split, also for a
+    # record much longer than the overlap between splits
+    global passed, failed
+    random.seed(1)
+    fd, path = tempfile.mkstemp(suffix = '.fa')
+    f = os.fdopen(fd, 'w')
+    for n in [200000, 50, 3000]:
+        seq = ''.join(random.choice('ACGT') for i in xrange(n))
+        f.write('>r%d\n' % n)
+        for i in xrange(0, n, 60):
+            f.write(seq[i:i + 60] + '\n')
+    f.close()
+    counts = []
+    for args in ['-b oa -m 1', '-b oa -m 8', '-b oa', '-e -m 1', '-e -m 8',
+            '-e']:
+        cmd = './obj/kmer %s %s -q' % (path, args)
+        print '[%s]' % cmd
+        p = subprocess.Popen(cmd, shell = True, stdout = subprocess.PIPE,
+                stderr = subprocess.PIPE)
+        err = p.communicate()[1]
+        m = re.search(r'Results has (\d+) elements', err)
+        counts.append(int(m.group(1)) if p.returncode == 0 and m else None)
+        print '\t%s k-mers' % counts[-1]
+    os.remove(path)
+    if counts[0] is not None and counts.count(counts[0]) == len(counts):
+        print '\tPASS'
+        passed += 1
+    else:
+        print '\tFAIL'
+        failed += 1
+
 def test_path(path):
     if os.path.exists(path):
         return path
@@ -57,6 +89,7 @@ def test_all():
     do_test("string_match", "data/sm_1GB.txt", test_path("data/wc/10MB.txt"))
 
     do_test("wc", "data/wc/300MB_1M_Keys.txt", test_path("data/wc/10MB.txt"))
+    test_kmer_splits()
     # this input is used for comparision with hadoop
     do_test("wc", "data/wc/10MB.txt -p 1", silent = True)
 